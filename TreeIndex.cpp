@@ -1,5 +1,12 @@
 #include "TreeIndex.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 int max_cols = 784;
 /**
  * @fn DataVector::DataVector(int dimension)
@@ -167,1048 +174,5556 @@ void DataVector::random_vector(int dimension)
     }
 }
 
-/**
- * @fn void VectorDataset::print_datavector()
- * @brief Prints the vectors in the dataset.
- */
-VectorDataset::VectorDataset()
+const double* DataVector::data() const
 {
-
+    return v.data();
 }
 
 /**
- * @fn VectorDataset::~VectorDataset()
- * @brief Destroys the VectorDataset and frees the memory.
+ * @fn double RowView::operator*(const DataVector &other) const
+ * @brief Dot product of the row with a DataVector.
+ * @param other The DataVector to calculate the dot product with.
+ * @return The dot product.
  */
-VectorDataset::~VectorDataset()
+double RowView::operator*(const DataVector &other) const
 {
-    vector<DataVector>().swap(v);
+    return dot(other.data());
 }
 
 /**
- * @fn VectorDataset & VectorDataset::operator=(const VectorDataset &other)
- * @brief Assigns the values from another VectorDataset.
- * @param other The other VectorDataset.
- * @return A reference to the VectorDataset.
+ * @fn double RowView::dot(const double* other) const
+ * @brief Dot product of the row with dimension doubles.
+ * @param other The first of the doubles.
+ * @return The dot product.
  */
-VectorDataset & VectorDataset::operator=(const VectorDataset &other)
+double RowView::dot(const double* other) const
 {
-    v = other.v;
-    return *this;
+    double product = 0.0;
+    for(int i = 0; i < n; i++)
+    {
+        product += p[i] * other[i];
+    }
+
+    return product;
 }
 
 /**
- * @fn void VectorDataset::ReadDataset()
- * @brief Reads the dataset from a file.
+ * @fn double RowView::distance(const DataVector &other) const
+ * @brief Euclidean distance between the row and a DataVector.
+ * @param other The DataVector to measure the distance to.
+ * @return The distance.
  */
-void VectorDataset::ReadDataset()
+double RowView::distance(const DataVector &other) const
 {
-    ifstream file("fmnist-train.csv");
-
-    if(file.is_open())
-    {
-        string line;
-        while(getline(file, line))
-        {
-            DataVector temp;
-            stringstream ss(line);
-            string value;
-
-            while(getline(ss, value, ','))
-            {
-                temp.input(stod(value));
-            }
-            v.push_back(temp);
-        }
-
-        file.close();
-    }
-    else
+    const double* o = other.data();
+    double magnitude = 0.0;
+    for(int i = 0; i < n; i++)
     {
-        printf("File not found\n");
+        double diff = p[i] - o[i];
+        magnitude += diff * diff;
     }
+
+    return sqrt(magnitude);
 }
 
 /**
- * @fn int VectorDataset::row_size()
- * @brief Gets the size of the dataset.
- * @return The size of the dataset.
+ * @fn DataVector RowView::to_datavector() const
+ * @brief Copies the row into a new DataVector.
+ * @return The copy.
  */
-int VectorDataset::row_size()
+DataVector RowView::to_datavector() const
 {
-    return v.size();
+    DataVector result;
+    for(int i = 0; i < n; i++)
+    {
+        result.input(p[i]);
+    }
+    return result;
 }
 
 /**
- * @fn DataVector VectorDataset::access_row(int i)
- * @brief Accesses a vector at a given index.
- * @param i The index.
- * @return The vector.
+ * @fn void RowView::print_vector() const
+ * @brief Prints the components of the row.
  */
-DataVector VectorDataset::access_row(int i)
+void RowView::print_vector() const
 {
-    return v[i];
+    for(int i = 0; i < n; i++)
+    {
+        printf("%.2lf ", (double)p[i]);
+    }
+    printf("\n");
 }
 
-double VectorDataset::access_element(int i, int j)
+/*
+ * Distance kernels. Each instruction set gets a squared distance and a dot
+ * product kernel, picked once at startup from what the CPU reports. The
+ * vector kernels keep four accumulators of scalar_t lanes and only add the
+ * lanes together in double at the end, so on integer pixel data every lane
+ * stays exact.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TREEINDEX_X86_KERNELS
+// GCC 12 flags the undefined passthrough of its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+static double squared_l2_scalar(const scalar_t* a, const scalar_t* b, int n)
 {
-    return v[i].get_element(j);
+    double sum = 0.0;
+    for(int i = 0; i < n; i++)
+    {
+        double diff = (double)a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
 }
 
-/**
- * @fn void VectorDataset::add_vector(DataVector vec)
- * @brief Adds a vector to the dataset.
- * @param vec The vector to add.
- */
-void VectorDataset::add_vector(DataVector vec)
+static double dot_scalar(const scalar_t* a, const scalar_t* b, int n)
 {
-    v.push_back(vec);
+    double sum = 0.0;
+    for(int i = 0; i < n; i++)
+    {
+        sum += (double)a[i] * b[i];
+    }
+    return sum;
 }
 
-void VectorDataset::erase_vector(int i)
+// The vector bounded kernels compare the partial sum with the bound after
+// this many blocks, the scalar one after every block
+static const int abandon_every = 4;
+
+static double squared_l2_bounded_scalar(const scalar_t* a, const scalar_t* b, const int* blocks, int count, double bound)
 {
-    v.erase(v.begin() + i);
+    double sum = 0.0;
+    for(int c = 0; c < count; c++)
+    {
+        sum += squared_l2_scalar(a + blocks[c], b + blocks[c], distance_kernels::block);
+        if(sum >= bound)
+        {
+            break;
+        }
+    }
+    return sum;
 }
 
-/**
- * @fn void VectorDataset::print_datavector()
- * @brief Prints the vectors in the dataset.
- */
-void VectorDataset::print_datavector()
+static void dot_rows_scalar(const scalar_t* const* rows, int count, const scalar_t* b, int n, double* out)
 {
-    for(int i = 0; i < v.size(); i++)
+    for(int r = 0; r < count; r++)
     {
-        v[i].print_vector();
+        out[r] = dot_scalar(rows[r], b, n);
     }
 }
 
-TreeIndex::TreeIndex()
+#ifdef TREEINDEX_X86_KERNELS
+
+#ifdef TREEINDEX_DOUBLE
+#define AVX2_VEC            __m256d
+#define AVX2_ZERO           _mm256_setzero_pd
+#define AVX2_LOAD           _mm256_loadu_pd
+#define AVX2_ADD            _mm256_add_pd
+#define AVX2_SUB            _mm256_sub_pd
+#define AVX2_FMA            _mm256_fmadd_pd
+#define AVX512_VEC          __m512d
+#define AVX512_ZERO         _mm512_setzero_pd
+#define AVX512_LOAD         _mm512_loadu_pd
+#define AVX512_ADD          _mm512_add_pd
+#define AVX512_SUB          _mm512_sub_pd
+#define AVX512_FMA          _mm512_fmadd_pd
+#else
+#define AVX2_VEC            __m256
+#define AVX2_ZERO           _mm256_setzero_ps
+#define AVX2_LOAD           _mm256_loadu_ps
+#define AVX2_ADD            _mm256_add_ps
+#define AVX2_SUB            _mm256_sub_ps
+#define AVX2_FMA            _mm256_fmadd_ps
+#define AVX512_VEC          __m512
+#define AVX512_ZERO         _mm512_setzero_ps
+#define AVX512_LOAD         _mm512_loadu_ps
+#define AVX512_ADD          _mm512_add_ps
+#define AVX512_SUB          _mm512_sub_ps
+#define AVX512_FMA          _mm512_fmadd_ps
+#endif
+
+static const int avx2_lanes = 32 / sizeof(scalar_t);
+static const int avx512_lanes = 64 / sizeof(scalar_t);
+
+// Adds the lanes of v together in double
+__attribute__((target("avx2,fma")))
+static double avx2_sum(AVX2_VEC v)
 {
-    D.ReadDataset();
+#ifdef TREEINDEX_DOUBLE
+    __m256d wide = v;
+#else
+    __m256d wide = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+#endif
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(wide), _mm256_extractf128_pd(wide, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
 }
 
-struct kd_tree_node* KDTreeIndex::new_kd_node(vector<int>* a, int h)
+__attribute__((target("avx2,fma")))
+static double squared_l2_avx2(const scalar_t* a, const scalar_t* b, int n)
 {
-    // Allocating memory for a new node
-    struct kd_tree_node* temp = new kd_tree_node();
-
-    // Sending the indices of this node into it's respective position
-    for(int i=0; i<a->size(); i++)
+    AVX2_VEC s0 = AVX2_ZERO(), s1 = AVX2_ZERO(), s2 = AVX2_ZERO(), s3 = AVX2_ZERO();
+    int i = 0;
+    for(; i + 4 * avx2_lanes <= n; i += 4 * avx2_lanes)
     {
-        temp->indices.push_back(a->at(i));
+        AVX2_VEC d0 = AVX2_SUB(AVX2_LOAD(a + i), AVX2_LOAD(b + i));
+        AVX2_VEC d1 = AVX2_SUB(AVX2_LOAD(a + i + avx2_lanes), AVX2_LOAD(b + i + avx2_lanes));
+        AVX2_VEC d2 = AVX2_SUB(AVX2_LOAD(a + i + 2 * avx2_lanes), AVX2_LOAD(b + i + 2 * avx2_lanes));
+        AVX2_VEC d3 = AVX2_SUB(AVX2_LOAD(a + i + 3 * avx2_lanes), AVX2_LOAD(b + i + 3 * avx2_lanes));
+        s0 = AVX2_FMA(d0, d0, s0);
+        s1 = AVX2_FMA(d1, d1, s1);
+        s2 = AVX2_FMA(d2, d2, s2);
+        s3 = AVX2_FMA(d3, d3, s3);
     }
-
-    // The height of this node is h
-    temp->height = h;
-
-    // Creating a duplicate vector to sort based on their h%maxcols
-    vector<double>* temp_vector = new vector<double>();
-
-    // Populating the temp_vector with the hth dimension of the indices
-    for(int i=0; i<a->size(); i++)
+    for(; i + avx2_lanes <= n; i += avx2_lanes)
     {
-        temp_vector->push_back(D.access_element(a->at(i), h%max_cols));
+        AVX2_VEC d0 = AVX2_SUB(AVX2_LOAD(a + i), AVX2_LOAD(b + i));
+        s0 = AVX2_FMA(d0, d0, s0);
     }
 
-    // Sorting the temp_vector
-    sort(temp_vector->begin(), temp_vector->end());
+    double sum = avx2_sum(AVX2_ADD(AVX2_ADD(s0, s1), AVX2_ADD(s2, s3)));
+    return sum + squared_l2_scalar(a + i, b + i, n - i);
+}
 
-    // Finding the median of the hth dimension
-    if(temp_vector->size() % 2 == 0)
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const scalar_t* a, const scalar_t* b, int n)
+{
+    AVX2_VEC s0 = AVX2_ZERO(), s1 = AVX2_ZERO(), s2 = AVX2_ZERO(), s3 = AVX2_ZERO();
+    int i = 0;
+    for(; i + 4 * avx2_lanes <= n; i += 4 * avx2_lanes)
     {
-        temp->median = (temp_vector->at(temp_vector->size()/2) + temp_vector->at(temp_vector->size()/2 - 1)) / 2;
+        s0 = AVX2_FMA(AVX2_LOAD(a + i), AVX2_LOAD(b + i), s0);
+        s1 = AVX2_FMA(AVX2_LOAD(a + i + avx2_lanes), AVX2_LOAD(b + i + avx2_lanes), s1);
+        s2 = AVX2_FMA(AVX2_LOAD(a + i + 2 * avx2_lanes), AVX2_LOAD(b + i + 2 * avx2_lanes), s2);
+        s3 = AVX2_FMA(AVX2_LOAD(a + i + 3 * avx2_lanes), AVX2_LOAD(b + i + 3 * avx2_lanes), s3);
     }
-    else
+    for(; i + avx2_lanes <= n; i += avx2_lanes)
     {
-        temp->median = temp_vector->at(temp_vector->size()/2);
+        s0 = AVX2_FMA(AVX2_LOAD(a + i), AVX2_LOAD(b + i), s0);
     }
 
-    vector<int>* temp_left = new vector<int>();
-    vector<int>* temp_right = new vector<int>();
+    double sum = avx2_sum(AVX2_ADD(AVX2_ADD(s0, s1), AVX2_ADD(s2, s3)));
+    return sum + dot_scalar(a + i, b + i, n - i);
+}
+
+// Adds the lanes of v together in double
+__attribute__((target("avx512f")))
+static double avx512_sum(AVX512_VEC v)
+{
+#ifdef TREEINDEX_DOUBLE
+    __m512d wide = v;
+#else
+    __m256 low = _mm512_castps512_ps256(v);
+    __m256 high = _mm512_castps512_ps256(_mm512_shuffle_f32x4(v, v, 0xEE));
+    __m512d wide = _mm512_add_pd(_mm512_cvtps_pd(low), _mm512_cvtps_pd(high));
+#endif
+    __m256d quarter = _mm256_add_pd(_mm512_castpd512_pd256(wide), _mm512_castpd512_pd256(_mm512_shuffle_f64x2(wide, wide, 0xEE)));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(quarter), _mm256_extractf128_pd(quarter, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
 
-    // Populating the left and right vectors based on the median
-    for(int i=0; i<a->size(); i++)
+// A block is two AVX2 vectors, the second going into the odd accumulators
+__attribute__((target("avx2,fma")))
+static double squared_l2_bounded_avx2(const scalar_t* a, const scalar_t* b, const int* blocks, int count, double bound)
+{
+    AVX2_VEC s0 = AVX2_ZERO(), s1 = AVX2_ZERO(), s2 = AVX2_ZERO(), s3 = AVX2_ZERO();
+    int c = 0;
+    for(; c + abandon_every <= count; c += abandon_every)
     {
-        if(D.access_element(a->at(i), h%max_cols) <= temp->median)
+        for(int j = c; j < c + abandon_every; j += 2)
         {
-            temp_left->push_back(a->at(i));
+            const scalar_t* x = a + blocks[j];
+            const scalar_t* y = b + blocks[j];
+            const scalar_t* u = a + blocks[j + 1];
+            const scalar_t* v = b + blocks[j + 1];
+            AVX2_VEC d0 = AVX2_SUB(AVX2_LOAD(x), AVX2_LOAD(y));
+            AVX2_VEC d1 = AVX2_SUB(AVX2_LOAD(x + avx2_lanes), AVX2_LOAD(y + avx2_lanes));
+            AVX2_VEC d2 = AVX2_SUB(AVX2_LOAD(u), AVX2_LOAD(v));
+            AVX2_VEC d3 = AVX2_SUB(AVX2_LOAD(u + avx2_lanes), AVX2_LOAD(v + avx2_lanes));
+            s0 = AVX2_FMA(d0, d0, s0);
+            s1 = AVX2_FMA(d1, d1, s1);
+            s2 = AVX2_FMA(d2, d2, s2);
+            s3 = AVX2_FMA(d3, d3, s3);
         }
-        else
+
+        double partial = avx2_sum(AVX2_ADD(AVX2_ADD(s0, s1), AVX2_ADD(s2, s3)));
+        if(partial >= bound)
         {
-            temp_right->push_back(a->at(i));
+            return partial;
         }
     }
-
-    // If the left vector is empty, then the left node is NULL
-    if(temp_left->empty())
+    for(; c < count; c++)
     {
-        temp->left = NULL;
+        const scalar_t* x = a + blocks[c];
+        const scalar_t* y = b + blocks[c];
+        AVX2_VEC d0 = AVX2_SUB(AVX2_LOAD(x), AVX2_LOAD(y));
+        AVX2_VEC d1 = AVX2_SUB(AVX2_LOAD(x + avx2_lanes), AVX2_LOAD(y + avx2_lanes));
+        s0 = AVX2_FMA(d0, d0, s0);
+        s1 = AVX2_FMA(d1, d1, s1);
     }
-    // If the left vector has only one element, then the left node is a leaf node
-    else if(temp_left->size() == 1)
-    {
-        struct kd_tree_node* templ = new kd_tree_node();
-        templ->indices.insert(templ->indices.end(), temp_left->begin(), temp_left->end());
-        templ->height = temp->height + 1;
-        templ->median = D.access_element(templ->indices[0], h%max_cols);
 
-        templ->left = NULL;
-        templ->right = NULL;
+    return avx2_sum(AVX2_ADD(AVX2_ADD(s0, s1), AVX2_ADD(s2, s3)));
+}
 
-        temp->left = templ; 
-    }
-    else
+// Four rows at a time, two accumulators each
+__attribute__((target("avx2,fma")))
+static void dot_rows_avx2(const scalar_t* const* rows, int count, const scalar_t* b, int n, double* out)
+{
+    int r = 0;
+    for(; r + 4 <= count; r += 4)
     {
-        // If the left vector has more than one element, then the left node is a new node
-        temp->left = new_kd_node(temp_left, temp->height + 1);
+        const scalar_t* a0 = rows[r];
+        const scalar_t* a1 = rows[r + 1];
+        const scalar_t* a2 = rows[r + 2];
+        const scalar_t* a3 = rows[r + 3];
+        AVX2_VEC s0 = AVX2_ZERO(), s1 = AVX2_ZERO(), s2 = AVX2_ZERO(), s3 = AVX2_ZERO();
+        AVX2_VEC t0 = AVX2_ZERO(), t1 = AVX2_ZERO(), t2 = AVX2_ZERO(), t3 = AVX2_ZERO();
+        int i = 0;
+        for(; i + 2 * avx2_lanes <= n; i += 2 * avx2_lanes)
+        {
+            AVX2_VEC x = AVX2_LOAD(b + i);
+            AVX2_VEC y = AVX2_LOAD(b + i + avx2_lanes);
+            s0 = AVX2_FMA(AVX2_LOAD(a0 + i), x, s0);
+            s1 = AVX2_FMA(AVX2_LOAD(a1 + i), x, s1);
+            s2 = AVX2_FMA(AVX2_LOAD(a2 + i), x, s2);
+            s3 = AVX2_FMA(AVX2_LOAD(a3 + i), x, s3);
+            t0 = AVX2_FMA(AVX2_LOAD(a0 + i + avx2_lanes), y, t0);
+            t1 = AVX2_FMA(AVX2_LOAD(a1 + i + avx2_lanes), y, t1);
+            t2 = AVX2_FMA(AVX2_LOAD(a2 + i + avx2_lanes), y, t2);
+            t3 = AVX2_FMA(AVX2_LOAD(a3 + i + avx2_lanes), y, t3);
+        }
+        for(; i + avx2_lanes <= n; i += avx2_lanes)
+        {
+            AVX2_VEC x = AVX2_LOAD(b + i);
+            s0 = AVX2_FMA(AVX2_LOAD(a0 + i), x, s0);
+            s1 = AVX2_FMA(AVX2_LOAD(a1 + i), x, s1);
+            s2 = AVX2_FMA(AVX2_LOAD(a2 + i), x, s2);
+            s3 = AVX2_FMA(AVX2_LOAD(a3 + i), x, s3);
+        }
+        out[r] = avx2_sum(AVX2_ADD(s0, t0)) + dot_scalar(a0 + i, b + i, n - i);
+        out[r + 1] = avx2_sum(AVX2_ADD(s1, t1)) + dot_scalar(a1 + i, b + i, n - i);
+        out[r + 2] = avx2_sum(AVX2_ADD(s2, t2)) + dot_scalar(a2 + i, b + i, n - i);
+        out[r + 3] = avx2_sum(AVX2_ADD(s3, t3)) + dot_scalar(a3 + i, b + i, n - i);
     }
-
-    // If the right vector is empty, then the right node is NULL
-    if(temp_right->empty())
+    for(; r < count; r++)
     {
-        temp->right = NULL;
+        out[r] = dot_avx2(rows[r], b, n);
     }
-    // If the right vector has only one element, then the right node is a leaf node
-    else if(temp_right->size() == 1)
-    {
-        struct kd_tree_node* tempr = new kd_tree_node();
-        tempr->indices.insert(tempr->indices.end(), temp_right->begin(), temp_right->end());
-        tempr->height = temp->height + 1;
-        tempr->median = D.access_element(tempr->indices[0], h%max_cols);
-
-        tempr->left = NULL;
-        tempr->right = NULL;
+}
 
-        temp->right = tempr; 
+__attribute__((target("avx512f")))
+static double squared_l2_avx512(const scalar_t* a, const scalar_t* b, int n)
+{
+    AVX512_VEC s0 = AVX512_ZERO(), s1 = AVX512_ZERO(), s2 = AVX512_ZERO(), s3 = AVX512_ZERO();
+    int i = 0;
+    for(; i + 4 * avx512_lanes <= n; i += 4 * avx512_lanes)
+    {
+        AVX512_VEC d0 = AVX512_SUB(AVX512_LOAD(a + i), AVX512_LOAD(b + i));
+        AVX512_VEC d1 = AVX512_SUB(AVX512_LOAD(a + i + avx512_lanes), AVX512_LOAD(b + i + avx512_lanes));
+        AVX512_VEC d2 = AVX512_SUB(AVX512_LOAD(a + i + 2 * avx512_lanes), AVX512_LOAD(b + i + 2 * avx512_lanes));
+        AVX512_VEC d3 = AVX512_SUB(AVX512_LOAD(a + i + 3 * avx512_lanes), AVX512_LOAD(b + i + 3 * avx512_lanes));
+        s0 = AVX512_FMA(d0, d0, s0);
+        s1 = AVX512_FMA(d1, d1, s1);
+        s2 = AVX512_FMA(d2, d2, s2);
+        s3 = AVX512_FMA(d3, d3, s3);
     }
-    else
+    for(; i + avx512_lanes <= n; i += avx512_lanes)
     {
-        // If the right vector has more than one element, then the right node is a new node
-        temp->right = new_kd_node(temp_right, temp->height + 1);
+        AVX512_VEC d0 = AVX512_SUB(AVX512_LOAD(a + i), AVX512_LOAD(b + i));
+        s0 = AVX512_FMA(d0, d0, s0);
     }
 
-    delete temp_vector;
-    delete temp_right;
-    delete temp_left;
-
-    return temp;
+    double sum = avx512_sum(AVX512_ADD(AVX512_ADD(s0, s1), AVX512_ADD(s2, s3)));
+    return sum + squared_l2_scalar(a + i, b + i, n - i);
 }
 
-void KDTreeIndex::print_kd_tree(struct kd_tree_node* head)
+__attribute__((target("avx512f")))
+static double dot_avx512(const scalar_t* a, const scalar_t* b, int n)
 {
-    if(head == NULL)
+    AVX512_VEC s0 = AVX512_ZERO(), s1 = AVX512_ZERO(), s2 = AVX512_ZERO(), s3 = AVX512_ZERO();
+    int i = 0;
+    for(; i + 4 * avx512_lanes <= n; i += 4 * avx512_lanes)
     {
-        return;
+        s0 = AVX512_FMA(AVX512_LOAD(a + i), AVX512_LOAD(b + i), s0);
+        s1 = AVX512_FMA(AVX512_LOAD(a + i + avx512_lanes), AVX512_LOAD(b + i + avx512_lanes), s1);
+        s2 = AVX512_FMA(AVX512_LOAD(a + i + 2 * avx512_lanes), AVX512_LOAD(b + i + 2 * avx512_lanes), s2);
+        s3 = AVX512_FMA(AVX512_LOAD(a + i + 3 * avx512_lanes), AVX512_LOAD(b + i + 3 * avx512_lanes), s3);
     }
-
-    printf("Height: %d\n", head->height);
-    printf("Median: %.2lf\n", head->median);
-    printf("Indices: ");
-    for(int i=0; i<head->indices.size(); i++)
+    for(; i + avx512_lanes <= n; i += avx512_lanes)
     {
-        printf("%d ", head->indices[i]);
+        s0 = AVX512_FMA(AVX512_LOAD(a + i), AVX512_LOAD(b + i), s0);
     }
-    printf("\n\n");
 
-    print_kd_tree(head->left);
-    print_kd_tree(head->right);
+    double sum = avx512_sum(AVX512_ADD(AVX512_ADD(s0, s1), AVX512_ADD(s2, s3)));
+    return sum + dot_scalar(a + i, b + i, n - i);
 }
 
-KDTreeIndex::KDTreeIndex()
+// A block is one AVX-512 vector
+__attribute__((target("avx512f")))
+static double squared_l2_bounded_avx512(const scalar_t* a, const scalar_t* b, const int* blocks, int count, double bound)
 {
-    auto start = chrono::high_resolution_clock::now();
-
-    // Creating a root node
-    struct kd_tree_node* temp = new kd_tree_node();
-
-    // Sending the all the indices in the DataSet
-    for(int i=0; i<D.row_size(); i++)
+    AVX512_VEC s0 = AVX512_ZERO(), s1 = AVX512_ZERO(), s2 = AVX512_ZERO(), s3 = AVX512_ZERO();
+    int c = 0;
+    for(; c + abandon_every <= count; c += abandon_every)
     {
-        temp->indices.push_back(i);
+        AVX512_VEC d0 = AVX512_SUB(AVX512_LOAD(a + blocks[c]), AVX512_LOAD(b + blocks[c]));
+        AVX512_VEC d1 = AVX512_SUB(AVX512_LOAD(a + blocks[c + 1]), AVX512_LOAD(b + blocks[c + 1]));
+        AVX512_VEC d2 = AVX512_SUB(AVX512_LOAD(a + blocks[c + 2]), AVX512_LOAD(b + blocks[c + 2]));
+        AVX512_VEC d3 = AVX512_SUB(AVX512_LOAD(a + blocks[c + 3]), AVX512_LOAD(b + blocks[c + 3]));
+        s0 = AVX512_FMA(d0, d0, s0);
+        s1 = AVX512_FMA(d1, d1, s1);
+        s2 = AVX512_FMA(d2, d2, s2);
+        s3 = AVX512_FMA(d3, d3, s3);
+
+        double partial = avx512_sum(AVX512_ADD(AVX512_ADD(s0, s1), AVX512_ADD(s2, s3)));
+        if(partial >= bound)
+        {
+            return partial;
+        }
     }
-
-    // Height 0 since it is a root node
-    temp->height = 0;
-
-    // Sorting the indices based on the first dimension
-    vector<double>* temp_vector = new vector<double>();
-
-    for(int i=0; i<D.row_size(); i++)
+    for(; c < count; c++)
     {
-        temp_vector->push_back(D.access_element(i, 0));
+        AVX512_VEC d0 = AVX512_SUB(AVX512_LOAD(a + blocks[c]), AVX512_LOAD(b + blocks[c]));
+        s0 = AVX512_FMA(d0, d0, s0);
     }
 
-    sort(temp_vector->begin(), temp_vector->end());
+    return avx512_sum(AVX512_ADD(AVX512_ADD(s0, s1), AVX512_ADD(s2, s3)));
+}
 
-    // Finding the medain of the nth-dimension
-    if(temp_vector->size() % 2 == 0)
+// Four rows at a time, two accumulators each
+__attribute__((target("avx512f")))
+static void dot_rows_avx512(const scalar_t* const* rows, int count, const scalar_t* b, int n, double* out)
+{
+    int r = 0;
+    for(; r + 4 <= count; r += 4)
     {
-        temp->median = (temp_vector->at(temp_vector->size()/2) + temp_vector->at(temp_vector->size()/2 - 1)) / 2;
+        const scalar_t* a0 = rows[r];
+        const scalar_t* a1 = rows[r + 1];
+        const scalar_t* a2 = rows[r + 2];
+        const scalar_t* a3 = rows[r + 3];
+        AVX512_VEC s0 = AVX512_ZERO(), s1 = AVX512_ZERO(), s2 = AVX512_ZERO(), s3 = AVX512_ZERO();
+        AVX512_VEC t0 = AVX512_ZERO(), t1 = AVX512_ZERO(), t2 = AVX512_ZERO(), t3 = AVX512_ZERO();
+        int i = 0;
+        for(; i + 2 * avx512_lanes <= n; i += 2 * avx512_lanes)
+        {
+            AVX512_VEC x = AVX512_LOAD(b + i);
+            AVX512_VEC y = AVX512_LOAD(b + i + avx512_lanes);
+            s0 = AVX512_FMA(AVX512_LOAD(a0 + i), x, s0);
+            s1 = AVX512_FMA(AVX512_LOAD(a1 + i), x, s1);
+            s2 = AVX512_FMA(AVX512_LOAD(a2 + i), x, s2);
+            s3 = AVX512_FMA(AVX512_LOAD(a3 + i), x, s3);
+            t0 = AVX512_FMA(AVX512_LOAD(a0 + i + avx512_lanes), y, t0);
+            t1 = AVX512_FMA(AVX512_LOAD(a1 + i + avx512_lanes), y, t1);
+            t2 = AVX512_FMA(AVX512_LOAD(a2 + i + avx512_lanes), y, t2);
+            t3 = AVX512_FMA(AVX512_LOAD(a3 + i + avx512_lanes), y, t3);
+        }
+        for(; i + avx512_lanes <= n; i += avx512_lanes)
+        {
+            AVX512_VEC x = AVX512_LOAD(b + i);
+            s0 = AVX512_FMA(AVX512_LOAD(a0 + i), x, s0);
+            s1 = AVX512_FMA(AVX512_LOAD(a1 + i), x, s1);
+            s2 = AVX512_FMA(AVX512_LOAD(a2 + i), x, s2);
+            s3 = AVX512_FMA(AVX512_LOAD(a3 + i), x, s3);
+        }
+        out[r] = avx512_sum(AVX512_ADD(s0, t0)) + dot_scalar(a0 + i, b + i, n - i);
+        out[r + 1] = avx512_sum(AVX512_ADD(s1, t1)) + dot_scalar(a1 + i, b + i, n - i);
+        out[r + 2] = avx512_sum(AVX512_ADD(s2, t2)) + dot_scalar(a2 + i, b + i, n - i);
+        out[r + 3] = avx512_sum(AVX512_ADD(s3, t3)) + dot_scalar(a3 + i, b + i, n - i);
     }
-    else
+    for(; r < count; r++)
     {
-        temp->median = temp_vector->at(temp_vector->size()/2);
+        out[r] = dot_avx512(rows[r], b, n);
     }
+}
 
-    vector<int>* temp_left = new vector<int>();
-    vector<int>* temp_right = new vector<int>();
+#endif
 
-    for(int i=0; i<D.row_size(); i++)
+/**
+ * @fn static const distance_kernels& distance_kernels::best()
+ * @brief Gives the kernels picked from CPUID on the first call.
+ *
+ * Setting TREEINDEX_KERNELS to "avx2" or "scalar" caps the instruction set,
+ * which helps when comparing the kernels.
+ *
+ * @return The kernels.
+ */
+const distance_kernels& distance_kernels::best()
+{
+    static const distance_kernels picked = []()
     {
-        if(D.access_element(temp->indices[i], 0) <= temp->median)
+        distance_kernels k = {"scalar", squared_l2_scalar, dot_scalar, squared_l2_bounded_scalar, dot_rows_scalar};
+#ifdef TREEINDEX_X86_KERNELS
+        const char* cap = getenv("TREEINDEX_KERNELS");
+        bool scalar_only = cap != NULL && strcmp(cap, "scalar") == 0;
+        bool avx2_only = cap != NULL && strcmp(cap, "avx2") == 0;
+
+        __builtin_cpu_init();
+        if(!scalar_only && !avx2_only && __builtin_cpu_supports("avx512f"))
         {
-            temp_left->push_back(temp->indices[i]);
+            k = {"avx512", squared_l2_avx512, dot_avx512, squared_l2_bounded_avx512, dot_rows_avx512};
         }
-        else
+        else if(!scalar_only && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
         {
-            temp_right->push_back(temp->indices[i]);
+            k = {"avx2", squared_l2_avx2, dot_avx2, squared_l2_bounded_avx2, dot_rows_avx2};
         }
-    }
+#endif
+        return k;
+    }();
+    return picked;
+}
 
-    if(temp_left->empty())
+/**
+ * @fn static bool check_kernels()
+ * @brief Compares the kernels in use with the scalar ones on random rows.
+ *
+ * Every length up to a few hundred components is tried, so the vector
+ * loops and their scalar tails are both covered. TREEINDEX_KERNELS must
+ * be obeyed too: "scalar" and "avx2" may not be exceeded.
+ *
+ * @return True if the kernels agree with the scalar ones.
+ */
+static bool check_kernels()
+{
+    const distance_kernels& kernels = distance_kernels::best();
+    const char* cap = getenv("TREEINDEX_KERNELS");
+    bool capped = cap != NULL && ((strcmp(cap, "scalar") == 0 && strcmp(kernels.name, "scalar") != 0)
+        || (strcmp(cap, "avx2") == 0 && strcmp(kernels.name, "avx512") == 0));
+
+    mt19937 generator(11);
+    uniform_real_distribution<double> random(-255.0, 255.0);
+    vector<scalar_t> a(300), b(300);
+    int wrong = 0;
+    for(int n = 0; n <= (int)a.size(); n++)
     {
-        temp->left = NULL;
+        for(int i = 0; i < (int)a.size(); i++)
+        {
+            a[i] = random(generator);
+            b[i] = random(generator);
+        }
+
+        // Only the order of the additions differs, so the results agree to rounding
+        double expected[2] = {squared_l2_scalar(a.data(), b.data(), n), dot_scalar(a.data(), b.data(), n)};
+        double got[2] = {kernels.squared_l2(a.data(), b.data(), n), kernels.dot(a.data(), b.data(), n)};
+        for(int t = 0; t < 2; t++)
+        {
+            double scale = 255.0 * 255.0 * max(n, 1);
+            wrong += fabs(got[t] - expected[t]) > 1e-5 * scale;
+        }
     }
-    else if(temp_left->size() == 1)
-    {
-        struct kd_tree_node* templ = new kd_tree_node();
-        templ->indices.insert(templ->indices.end(), temp_left->begin(), temp_left->end());
-        templ->height = temp->height + 1;
-        templ->median = D.access_element(templ->indices[0], templ->height);
 
-        templ->left = NULL;
-        templ->right = NULL;
+    printf("Kernels: %s, wrong results: %d%s\n", kernels.name, wrong, capped ? ", TREEINDEX_KERNELS not obeyed" : "");
+    return wrong == 0 && !capped;
+}
+
+int ThreadPool::threads = 0;
+thread_local int ThreadPool::current = -1;
+
+/**
+ * @fn ThreadPool::ThreadPool(int size)
+ * @brief Starts size - 1 workers, the thread that waits is the last one.
+ * @param size The number of threads running tasks.
+ */
+ThreadPool::ThreadPool(int size) : pending(0), stopping(false)
+{
+    size = max(size, 1);
 
-        temp->left = templ; 
+    // One queue per worker and a last one for threads outside the pool
+    for(int i = 0; i < size; i++)
+    {
+        queues.emplace_back(new task_queue());
     }
-    else
+    for(int i = 0; i < size - 1; i++)
     {
-        temp->left = new_kd_node(temp_left, temp->height + 1);
+        workers.emplace_back(&ThreadPool::work, this, i);
     }
+}
 
-    if(temp_right->empty())
+/**
+ * @fn ThreadPool::~ThreadPool()
+ * @brief Stops and joins the workers.
+ */
+ThreadPool::~ThreadPool()
+{
     {
-        temp->right = NULL;
+        lock_guard<mutex> guard(sleep_lock);
+        stopping = true;
     }
-    else if(temp_right->size() == 1)
-    {
-        struct kd_tree_node* tempr = new kd_tree_node();
-        tempr->indices.insert(tempr->indices.end(), temp_right->begin(), temp_right->end());
-        tempr->height = temp->height + 1;
-        tempr->median = D.access_element(tempr->indices[0], tempr->height);
-
-        tempr->left = NULL;
-        tempr->right = NULL;
+    wake.notify_all();
 
-        temp->right = tempr; 
-    }
-    else
+    for(auto& worker : workers)
     {
-        temp->right = new_kd_node(temp_right, temp->height + 1);
+        worker.join();
     }
-    
-    root = temp;
-    printf("\nKD-Tree successfully built\n");
-    delete temp_vector;
-    delete temp_left;
-    delete temp_right;
-
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
-    printf("Time taken to build KD-Tree: %ld ms\n\n", duration.count());
 }
 
-TreeIndex* TreeIndex::instance = nullptr;
-KDTreeIndex* KDTreeIndex::kdinstance = nullptr;
-RPTreeIndex* RPTreeIndex::rpinstance = nullptr;
-
-void delete_kd_tree(struct kd_tree_node*& head)
+/**
+ * @fn void ThreadPool::submit(function<void()> task)
+ * @brief Queues a task on the calling thread's queue.
+ * @param task The task.
+ */
+void ThreadPool::submit(function<void()> task)
 {
-    if(head == NULL)
+    task_queue& queue = *queues[current >= 0 ? current : queues.size() - 1];
     {
-        return;
+        lock_guard<mutex> guard(queue.lock);
+        queue.tasks.push_back(move(task));
     }
+    pending++;
 
-    delete_kd_tree(head->left);
-    delete_kd_tree(head->right);
-    delete head;
-
-    head = NULL;
+    // Taking the lock keeps a worker from missing the wake up between its check and its wait
+    {
+        lock_guard<mutex> guard(sleep_lock);
+    }
+    wake.notify_one();
 }
 
-void KDTreeIndex::add_kd_vector(DataVector temp)
+/**
+ * @fn bool ThreadPool::run_one()
+ * @brief Runs one queued task on the calling thread, stealing if needed.
+ * @return False if there was nothing to run.
+ */
+bool ThreadPool::run_one()
 {
-    int d = temp.get_the_size();
+    int own = current >= 0 ? current : queues.size() - 1;
+    function<void()> task;
 
-    if(d > max_cols)
+    // The newest task of our own queue first, it shares the most with what we just did
     {
-        printf("Dimension exceeds the maximum dimension\n");
-        return;
-    }
-
-    TreeIndex::GetInstance().add_datavector(temp);
-
-    ofstream file("fmnist-train.csv", ios::app);
-    if (!file.is_open()) {
-        cout << "Failed to open the file." << endl;
-        return; // Exit if file not opened successfully
+        task_queue& queue = *queues[own];
+        lock_guard<mutex> guard(queue.lock);
+        if(!queue.tasks.empty())
+        {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
     }
 
-    // Write the elements of the vector to the file
-    for (int i = 0; i < d; i++) {
-        if(i != max_cols-1) file << fixed << setprecision(1) << temp.get_element(i) << ",";
-        else file << fixed << setprecision(1) << temp.get_element(i); 
+    // Otherwise the oldest task of another queue, which tends to be the largest
+    for(int i = 1; !task && i < (int)queues.size(); i++)
+    {
+        task_queue& queue = *queues[(own + i) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        if(!queue.tasks.empty())
+        {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
     }
 
-    // Fill the remaining positions with 0.0 if the vector size is less than max_cols
-    for (int i = d; i < max_cols; i++) {
-        if(i != max_cols-1) file << fixed << setprecision(1) << 0.0 << ",";
-        else file << fixed << setprecision(1) << 0.0;
+    if(!task)
+    {
+        return false;
     }
-    file << "\n"; // Add a newline character at the end of the line
-
-    // Close the file
-    file.close();
-
-    delete_kd_tree(KDTreeIndex::root);
-
-    KDTreeIndex::kdinstance = nullptr;
-    printf("KD-Tree successfully updated on addition\n");
 
+    pending--;
+    task();
+    return true;
 }
 
-void KDTreeIndex::delete_kd_vector(int d)
+/**
+ * @fn void ThreadPool::sleep(const atomic<int>& unfinished)
+ * @brief Blocks until a task is queued or unfinished drops to 0.
+ * @param unfinished The task count of the group being waited for.
+ */
+void ThreadPool::sleep(const atomic<int>& unfinished)
 {
+    unique_lock<mutex> guard(sleep_lock);
+    wake.wait(guard, [&]() { return pending > 0 || unfinished == 0; });
+}
 
-    if(d > D.row_size())
+/**
+ * @fn void ThreadPool::wake_all()
+ * @brief Wakes every sleeping thread, after a group's last task finished.
+ */
+void ThreadPool::wake_all()
+{
+    // Taking the lock keeps a waiter from missing the wake up between its check and its wait
     {
-        printf("Index exceeds the maximum index\n");
-        return;
+        lock_guard<mutex> guard(sleep_lock);
     }
+    wake.notify_all();
+}
 
-    D.erase_vector(d);
+/**
+ * @fn void ThreadPool::work(int id)
+ * @brief The loop of a worker thread.
+ * @param id The worker's queue.
+ */
+void ThreadPool::work(int id)
+{
+    current = id;
 
-    ofstream file("fmnist-train.csv", ios::trunc);
-    
-    if (!file.is_open()) {
-        cout << "Failed to open the file." << endl;
-        return; // Exit if file not opened successfully
-    }
+    while(true)
+    {
+        if(run_one())
+        {
+            continue;
+        }
 
-    // Write the elements of the vector to the file
-    for (int i = 0; i < D.row_size(); i++) {
-        for (int j = 0; j < D.access_row(i).get_the_size(); j++) {
-            if(j != max_cols-1) file << fixed << setprecision(1) << D.access_element(i, j) << ",";
-            else file << fixed << setprecision(1) << D.access_element(i, j);
+        unique_lock<mutex> guard(sleep_lock);
+        wake.wait(guard, [this]() { return pending > 0 || stopping; });
+        if(stopping)
+        {
+            return;
         }
-        file << "\n"; // Add a newline character at the end of the line
     }
+}
 
-    // Close the file
-    file.close();
-
-    delete_kd_tree(KDTreeIndex::root);
-
-    KDTreeIndex::kdinstance = nullptr;
-    printf("KD-Tree successfully updated after deletion\n");
+/**
+ * @fn static ThreadPool& ThreadPool::shared()
+ * @brief Gives the pool shared by the whole program, started on the first call.
+ * @return The shared pool.
+ */
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool(threads > 0 ? threads : max((int)thread::hardware_concurrency(), 1));
+    return pool;
 }
 
-void RPTreeIndex::print_rp_tree(struct rp_tree_node* head)
+/**
+ * @fn void TaskGroup::run(function<void()> task)
+ * @brief Starts a task of the group.
+ * @param task The task.
+ */
+void TaskGroup::run(function<void()> task)
 {
-    if(head == NULL)
+    if(pool.size() <= 1)
     {
+        task();
         return;
     }
 
-    printf("Height: %d\n", head->height);
-    printf("Median: %.2lf\n", head->median);
-    printf("Median Vector: ");
-    head->median_vector.print_vector();
-    printf("Indices: ");
-    for(int i=0; i<head->indices.size(); i++)
+    // The group may be gone once unfinished reaches 0, the pool outlives it
+    ThreadPool& owner = pool;
+    unfinished++;
+    pool.submit([this, task, &owner]()
     {
-        printf("%d ", head->indices[i]);
-    }
-    printf("\n\n");
-
-    print_rp_tree(head->left);
-    print_rp_tree(head->right);
+        task();
+        if(--unfinished == 0)
+        {
+            owner.wake_all();
+        }
+    });
 }
 
-struct rp_tree_node* RPTreeIndex::new_rp_node(vector<int>* a, int h)
+/**
+ * @fn void TaskGroup::wait()
+ * @brief Runs queued tasks until every task of the group has finished.
+ */
+void TaskGroup::wait()
 {
-    // Allocating memory for a new node
-    struct rp_tree_node* temp = new rp_tree_node();
-
-    // Sending the indices of this node into it's respective postion
-    for(int i=0; i<a->size(); i++)
+    while(unfinished > 0)
     {
-        temp->indices.push_back(a->at(i));
+        if(!pool.run_one())
+        {
+            pool.sleep(unfinished);
+        }
     }
+}
 
-    // The height of this node is h
-    temp->height = h;
+// Alignment of the dataset buffer and of every row inside it, in bytes
+static const int row_alignment = 64;
 
-    // Allocating the random vector
-    temp->median_vector.random_vector(max_cols);
+static scalar_t* alloc_rows(size_t components)
+{
+    size_t bytes = components * sizeof(scalar_t);
+    bytes = (bytes + row_alignment - 1) / row_alignment * row_alignment;
+#ifdef _WIN32
+    return (scalar_t*)_aligned_malloc(bytes, row_alignment);
+#else
+    return (scalar_t*)aligned_alloc(row_alignment, bytes);
+#endif
+}
 
-    // Temporary vector to store the dot products
-    vector<double>* temp_vector = new vector<double>();
+static void free_rows(scalar_t* p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
 
-    // Populating the vector with all the dot products
-    for(int i = 0; i < a->size(); i++)
-    {
-        temp_vector->push_back(D.access_row(a->at(i)) * temp->median_vector);
-    }
+/**
+ * @fn VectorDataset::VectorDataset()
+ * @brief Constructs a new, empty VectorDataset.
+ */
+VectorDataset::VectorDataset()
+{
+    m = NULL;
+    rows = 0;
+    cols = 0;
+    stride = 0;
+    capacity = 0;
+    deleted = 0;
+}
 
-    // Sorting the temp_vector
-    sort(temp_vector->begin(), temp_vector->end());
+/**
+ * @fn VectorDataset::~VectorDataset()
+ * @brief Destroys the VectorDataset and frees the memory.
+ */
+VectorDataset::~VectorDataset()
+{
+    release();
+}
 
-    // Finding the median
-    if(temp_vector->size() % 2 == 0)
+/**
+ * @fn dataset_storage::~dataset_storage()
+ * @brief Frees the matrix, or unmaps it if it is backed by a file.
+ */
+dataset_storage::~dataset_storage()
+{
+    if(mapping != NULL)
     {
-        temp->median = (temp_vector->at(temp_vector->size()/2) + temp_vector->at(temp_vector->size()/2 - 1)) / 2;
+#ifndef _WIN32
+        munmap(mapping, mapping_size);
+#endif
     }
     else
     {
-        temp->median = temp_vector->at(temp_vector->size()/2);
+        free_rows(m);
     }
+}
 
-    vector<int>* temp_left = new vector<int>();
-    vector<int>* temp_right = new vector<int>();
+/**
+ * @fn void VectorDataset::release()
+ * @brief Lets go of the storage. Snapshots still holding it keep it alive.
+ */
+void VectorDataset::release()
+{
+    storage.reset();
+    m = NULL;
+    capacity = 0;
+}
 
-    for(int i = 0; i < a->size(); i++)
-    {
-        if(D.access_row(a->at(i)) * temp->median_vector <= temp->median)
-        {
-            temp_left->push_back(a->at(i));
-        }
+/**
+ * @fn void VectorDataset::move_to(int new_capacity)
+ * @brief Copies the rows, their norms and their tombstones into new private storage.
+ *
+ * The old storage is left as it was, so searches reading it through a
+ * snapshot are not disturbed.
+ *
+ * @param new_capacity The number of rows the new storage can hold.
+ */
+void VectorDataset::move_to(int new_capacity)
+{
+    shared_ptr<dataset_storage> temp = make_shared<dataset_storage>();
+    temp->m = alloc_rows((size_t)new_capacity * stride);
+    temp->norms.reserve(new_capacity);
+    temp->tombstones.resize(((size_t)new_capacity + 63) / 64);
+
+    if(storage != NULL)
+    {
+        if(rows > 0)
+        {
+            memcpy(temp->m, m, (size_t)rows * stride * sizeof(scalar_t));
+        }
+        temp->norms.assign(storage->norms.begin(), storage->norms.end());
+        copy_n(storage->tombstones.begin(), min(storage->tombstones.size(), temp->tombstones.size()), temp->tombstones.begin());
+    }
+
+    storage = temp;
+    m = temp->m;
+    capacity = new_capacity;
+}
+
+/**
+ * @fn void VectorDataset::detach()
+ * @brief Copies a memory-mapped dataset into private memory before it is modified.
+ */
+void VectorDataset::detach()
+{
+    if(storage == NULL || storage->mapping == NULL)
+    {
+        return;
+    }
+    move_to(max(rows, 1));
+}
+
+/**
+ * @fn VectorDataset::VectorDataset(const VectorDataset &other)
+ * @brief Copy constructor for the VectorDataset class.
+ * @param other The VectorDataset to copy.
+ */
+VectorDataset::VectorDataset(const VectorDataset &other)
+{
+    m = NULL;
+    rows = 0;
+    cols = 0;
+    stride = 0;
+    capacity = 0;
+    deleted = 0;
+    *this = other;
+}
+
+/**
+ * @fn VectorDataset & VectorDataset::operator=(const VectorDataset &other)
+ * @brief Assigns the values from another VectorDataset.
+ * @param other The other VectorDataset.
+ * @return A reference to the VectorDataset.
+ */
+VectorDataset & VectorDataset::operator=(const VectorDataset &other)
+{
+    if(this == &other)
+    {
+        return *this;
+    }
+
+    release();
+    rows = 0;
+    cols = other.cols;
+    stride = other.stride;
+
+    reserve(other.rows);
+    if(other.rows > 0)
+    {
+        memcpy(m, other.m, (size_t)other.rows * stride * sizeof(scalar_t));
+        storage->norms = other.storage->norms;
+        copy_n(other.storage->tombstones.begin(), ((size_t)other.rows + 63) / 64, storage->tombstones.begin());
+    }
+    rows = other.rows;
+    deleted = other.deleted;
+    return *this;
+}
+
+/**
+ * @fn void VectorDataset::reserve(int n)
+ * @brief Grows the buffer so that it can hold at least n rows.
+ * @param n The number of rows.
+ */
+void VectorDataset::reserve(int n)
+{
+    if(storage != NULL && n <= capacity && storage->mapping == NULL)
+    {
+        return;
+    }
+    move_to(max(n, max(2 * capacity, 16)));
+}
+
+/**
+ * @fn void VectorDataset::compute_norms()
+ * @brief Recomputes the squared norms of all the rows.
+ */
+void VectorDataset::compute_norms()
+{
+    const distance_kernels& kernels = distance_kernels::best();
+    vector<double>& norms = storage->norms;
+    norms.resize(rows);
+    for(int i = 0; i < rows; i++)
+    {
+        const scalar_t* r = m + (size_t)i * stride;
+        norms[i] = kernels.dot(r, r, stride);
+    }
+}
+
+/**
+ * @fn bool VectorDataset::ReadDataset()
+ * @brief Reads the dataset from a file.
+ *
+ * Once fmnist-train.bin exists it is the dataset: checkpoints fold the
+ * added rows into it and empty the mutation log, so it may hold rows the
+ * CSV never had. fmnist-train.csv is only parsed when there is no binary
+ * copy yet, which is then written so the next start maps it instead. An
+ * edited CSV is brought in with --convert. The rows listed in
+ * fmnist-train.deleted are then marked deleted.
+ *
+ * @return False if neither file could be read.
+ */
+bool VectorDataset::ReadDataset()
+{
+    const char* csv_path = "fmnist-train.csv";
+    const char* bin_path = "fmnist-train.bin";
+
+    FILE* bin = fopen(bin_path, "rb");
+    if(bin != NULL)
+    {
+        fclose(bin);
+
+        // Parsing the CSV instead would lose every checkpointed row
+        if(!MapBinary(bin_path))
+        {
+            printf("Cannot read %s, rewrite it with --convert or remove it to start from %s\n", bin_path, csv_path);
+            return false;
+        }
+    }
+    else if(ReadCSV(csv_path))
+    {
+        WriteBinary(bin_path);
+    }
+    else
+    {
+        printf("File not found\n");
+        return false;
+    }
+
+    // Deleted rows stay in the data files, their indices are listed on the side
+    ifstream deletions("fmnist-train.deleted");
+    int d;
+    while(deletions >> d)
+    {
+        delete_vector(d);
+    }
+    return true;
+}
+
+// Size of the blocks the CSV file is read in, and the least amount of the
+// file worth handing to a parser thread of its own
+static const size_t csv_block_size = 1 << 20;
+
+/**
+ * @fn static bool blank_line(const char* p, const char* end)
+ * @brief Checks whether the line starting at p has nothing but whitespace.
+ */
+static bool blank_line(const char* p, const char* end)
+{
+    while(p < end && *p != '\n')
+    {
+        if(*p != '\r' && *p != ' ' && *p != '\t')
+        {
+            return false;
+        }
+        p++;
+    }
+    return true;
+}
+
+/**
+ * @fn static const char* next_line(const char* p, const char* end)
+ * @brief Finds the start of the line after the one containing p.
+ */
+static const char* next_line(const char* p, const char* end)
+{
+    p = (const char*)memchr(p, '\n', end - p);
+    return p == NULL ? end : p + 1;
+}
+
+/**
+ * @fn static const char* parse_csv_line(const char* p, const char* end, scalar_t* row, int cols, int& fields)
+ * @brief Parses one line of comma separated numbers straight into a row.
+ *
+ * Only the first cols fields are stored. The caller rejects a line whose
+ * number of fields is not cols.
+ *
+ * @param fields Set to the number of fields on the line.
+ * @return The start of the next line.
+ */
+static const char* parse_csv_line(const char* p, const char* end, scalar_t* row, int cols, int& fields)
+{
+    int j = 0;
+    while(p < end && *p != '\n')
+    {
+        while(p < end && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+
+        scalar_t value = 0;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        from_chars_result result = from_chars(p, end, value);
+        if(result.ec == errc())
+        {
+            p = result.ptr;
+        }
+#else
+        char* stop;
+        value = strtod(p, &stop);
+        p = stop;
+#endif
+        if(j < cols)
+        {
+            row[j] = value;
+        }
+        j++;
+
+        // Skip to the next field
+        while(p < end && *p != ',' && *p != '\n')
+        {
+            p++;
+        }
+        if(p < end && *p == ',')
+        {
+            p++;
+        }
+    }
+
+    fields = j;
+    for(; j < cols; j++)
+    {
+        row[j] = 0;
+    }
+    return p < end ? p + 1 : end;
+}
+
+/**
+ * @fn bool VectorDataset::ReadCSV(const char* path)
+ * @brief Appends every line of a CSV file to the dataset.
+ *
+ * The file is read in large blocks and cut into pieces at line boundaries,
+ * one piece per thread of the shared pool. Each thread counts the lines of
+ * its piece, and once the buffer has room for all of them, parses its
+ * numbers in place into its own rows. Nothing is allocated per line or
+ * per field. The dimension of an empty dataset is taken from the number of
+ * fields on the first line, and every other line must have as many. A file
+ * with a line that does not is rejected whole and adds no rows.
+ *
+ * @param path The CSV file.
+ * @return False if the file could not be opened or has a ragged line.
+ */
+bool VectorDataset::ReadCSV(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    vector<char> text;
+    size_t length = 0;
+    while(true)
+    {
+        text.resize(length + csv_block_size);
+        size_t got = fread(text.data() + length, 1, csv_block_size, file);
+        length += got;
+        if(got < csv_block_size)
+        {
+            break;
+        }
+    }
+    fclose(file);
+
+    const char* begin = text.data();
+    const char* end = begin + length;
+
+    // The first line that is not blank decides the dimension
+    const char* first = begin;
+    while(first < end && blank_line(first, end))
+    {
+        first = next_line(first, end);
+    }
+    if(first == end)
+    {
+        return true;
+    }
+
+    // A rejected file leaves the dimension of an empty dataset unset again
+    int old_cols = cols;
+    int old_stride = stride;
+    if(cols == 0)
+    {
+        int per_line = row_alignment / sizeof(scalar_t);
+        const char* stop = (const char*)memchr(first, '\n', end - first);
+        cols = 1 + count(first, stop == NULL ? end : stop, ',');
+        stride = (cols + per_line - 1) / per_line * per_line;
+    }
+
+    // Cut the text into pieces that start at the beginning of a line
+    int pieces = max(1, min(ThreadPool::shared().size(), (int)(length / csv_block_size)));
+    vector<const char*> cuts(pieces + 1);
+    cuts[0] = first;
+    cuts[pieces] = end;
+    for(int t = 1; t < pieces; t++)
+    {
+        const char* p = first + (end - first) * t / pieces;
+        cuts[t] = max(cuts[t - 1], next_line(p - 1, end));
+    }
+
+    auto run = [pieces](function<void(int)> work)
+    {
+        TaskGroup group;
+        for(int t = 1; t < pieces; t++)
+        {
+            group.run([&work, t]() { work(t); });
+        }
+        work(0);
+        group.wait();
+    };
+
+    // Count the rows of every piece to know where its rows go, and its lines to report errors by line
+    vector<int> offsets(pieces + 1, 0);
+    vector<int> line_numbers(pieces + 1, 0);
+    run([&](int t)
+    {
+        int lines = 0;
+        for(const char* p = cuts[t]; p < cuts[t + 1]; p = next_line(p, end))
+        {
+            lines += !blank_line(p, end);
+            line_numbers[t + 1]++;
+        }
+        offsets[t + 1] = lines;
+    });
+    offsets[0] = rows;
+    line_numbers[0] = 1 + count(begin, first, '\n');
+    for(int t = 0; t < pieces; t++)
+    {
+        offsets[t + 1] += offsets[t];
+        line_numbers[t + 1] += line_numbers[t];
+    }
+
+    reserve(offsets[pieces]);
+    vector<double>& norms = storage->norms;
+    norms.resize(offsets[pieces]);
+
+    // Every piece remembers its first ragged line, the earliest one is reported
+    const distance_kernels& kernels = distance_kernels::best();
+    vector<pair<int, int>> ragged(pieces, make_pair(0, 0));
+    run([&](int t)
+    {
+        int r = offsets[t];
+        int line = line_numbers[t];
+        for(const char* p = cuts[t]; p < cuts[t + 1]; line++)
+        {
+            if(blank_line(p, end))
+            {
+                p = next_line(p, end);
+                continue;
+            }
+            scalar_t* row = m + (size_t)r * stride;
+            int fields;
+            p = parse_csv_line(p, end, row, cols, fields);
+            if(fields != cols)
+            {
+                ragged[t] = make_pair(line, fields);
+                return;
+            }
+            fill(row + cols, row + stride, (scalar_t)0);
+            norms[r] = kernels.dot(row, row, stride);
+            r++;
+        }
+    });
+
+    for(auto& bad : ragged)
+    {
+        if(bad.first > 0)
+        {
+            printf("Line %d of %s has %d fields instead of %d\n", bad.first, path, bad.second, cols);
+            norms.resize(rows);
+            cols = old_cols;
+            stride = old_stride;
+            return false;
+        }
+    }
+
+    rows = offsets[pieces];
+    return true;
+}
+
+/**
+ * @fn bool VectorDataset::WriteBinary(const char* path)
+ * @brief Writes the dataset in the binary dataset format.
+ * @param path The binary file.
+ * @return False if the file could not be written.
+ */
+bool VectorDataset::WriteBinary(const char* path)
+{
+    dataset_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "KNNDSET", 8);
+    header.version = dataset_format_version;
+    header.dtype = sizeof(scalar_t);
+    header.rows = rows;
+    header.cols = cols;
+    header.stride = stride;
+    header.alignment = row_alignment;
+    header.header_size = sizeof(dataset_header);
+
+    // Write to a temporary file first so that a process mapping the old
+    // file never sees a half written one
+    string temp_path = string(path) + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if(ok && rows > 0)
+    {
+        ok = fwrite(m, sizeof(scalar_t) * stride, rows, file) == (size_t)rows;
+    }
+
+    // A checkpoint empties the mutation log right after, so the data must be on disk first
+    ok = fflush(file) == 0 && ok;
+#ifndef _WIN32
+    ok = fsync(fileno(file)) == 0 && ok;
+#endif
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok)
+    {
+        remove(temp_path.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(temp_path.c_str(), path) == 0;
+}
+
+/**
+ * @fn bool VectorDataset::MapBinary(const char* path)
+ * @brief Replaces the dataset with a memory mapping of a binary dataset file.
+ * @param path The binary file.
+ * @return False if the file is missing or was written in another format.
+ */
+bool VectorDataset::MapBinary(const char* path)
+{
+    dataset_header header;
+
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        return false;
+    }
+    bool ok = fread(&header, sizeof(header), 1, file) == 1;
+
+    if(!ok || memcmp(header.magic, "KNNDSET", 8) != 0 || header.version != dataset_format_version
+        || header.dtype != sizeof(scalar_t) || header.header_size % row_alignment != 0
+        || header.stride < header.cols || header.rows > INT_MAX)
+    {
+        fclose(file);
+        return false;
+    }
+
+    size_t bytes = header.header_size + (size_t)header.rows * header.stride * sizeof(scalar_t);
+
+#ifdef _WIN32
+    // No shared mapping here, fall back to reading the matrix in one go
+    scalar_t* temp = alloc_rows(max((size_t)header.rows, (size_t)1) * header.stride);
+    fseek(file, header.header_size, SEEK_SET);
+    ok = fread(temp, sizeof(scalar_t) * header.stride, header.rows, file) == header.rows;
+    fclose(file);
+    if(!ok)
+    {
+        free_rows(temp);
+        return false;
+    }
+
+    release();
+    storage = make_shared<dataset_storage>();
+    storage->m = temp;
+    m = temp;
+    capacity = max((int)header.rows, 1);
+#else
+    fclose(file);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < bytes)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* temp = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(temp == MAP_FAILED)
+    {
+        return false;
+    }
+
+    release();
+    storage = make_shared<dataset_storage>();
+    storage->mapping = temp;
+    storage->mapping_size = bytes;
+    storage->m = (scalar_t*)((char*)temp + header.header_size);
+    m = storage->m;
+    capacity = header.rows;
+#endif
+
+    // The rows are all new, none of them is deleted
+    storage->norms.reserve(capacity);
+    storage->tombstones.resize(((size_t)capacity + 63) / 64);
+    deleted = 0;
+    rows = header.rows;
+    cols = header.cols;
+    stride = header.stride;
+    compute_norms();
+    return true;
+}
+
+/**
+ * @fn static bool VectorDataset::ConvertDataset(const char* csv_path, const char* bin_path)
+ * @brief Converts a CSV dataset into the binary dataset format.
+ * @param csv_path The CSV file to read.
+ * @param bin_path The binary file to write.
+ * @return False if either file could not be opened.
+ */
+bool VectorDataset::ConvertDataset(const char* csv_path, const char* bin_path)
+{
+    VectorDataset temp;
+    return temp.ReadCSV(csv_path) && temp.WriteBinary(bin_path);
+}
+
+/**
+ * @fn dataset_snapshot VectorDataset::snapshot() const
+ * @brief Takes a snapshot of the rows, which stays readable however the dataset changes.
+ *
+ * Rows are only ever added past the end of the storage, and moving to a
+ * new storage leaves the old one alone, so the snapshot only has to hold
+ * on to the storage.
+ *
+ * @return The snapshot.
+ */
+dataset_snapshot VectorDataset::snapshot() const
+{
+    dataset_snapshot view;
+    view.storage = storage;
+    if(storage != NULL)
+    {
+        view.m = m;
+        view.norms = storage->norms.data();
+        view.tombstones = storage->tombstones.data();
+    }
+    view.rows = rows;
+    view.cols = cols;
+    view.stride = stride;
+    return view;
+}
+
+/**
+ * @fn int VectorDataset::row_size()
+ * @brief Gets the size of the dataset.
+ * @return The size of the dataset.
+ */
+int VectorDataset::row_size()
+{
+    return rows;
+}
+
+/**
+ * @fn int VectorDataset::dimension()
+ * @brief Gets the dimension of the vectors in the dataset.
+ * @return The dimension.
+ */
+int VectorDataset::dimension()
+{
+    return cols;
+}
+
+/**
+ * @fn DataVector VectorDataset::access_row(int i)
+ * @brief Accesses a copy of the vector at a given index.
+ * @param i The index.
+ * @return The vector.
+ */
+DataVector VectorDataset::access_row(int i)
+{
+    return row(i).to_datavector();
+}
+
+double VectorDataset::access_element(int i, int j)
+{
+    return m[(size_t)i * stride + j];
+}
+
+/**
+ * @fn void VectorDataset::add_vector(DataVector vec)
+ * @brief Adds a vector to the dataset.
+ *
+ * The first vector fixes the dimension of the dataset. Shorter vectors are
+ * padded with zeros and longer ones are truncated.
+ *
+ * @param vec The vector to add.
+ */
+void VectorDataset::add_vector(DataVector vec)
+{
+    if(cols == 0)
+    {
+        int per_line = row_alignment / sizeof(scalar_t);
+        cols = vec.get_the_size();
+        stride = (cols + per_line - 1) / per_line * per_line;
+    }
+
+    reserve(rows + 1);
+
+    scalar_t* r = m + (size_t)rows * stride;
+    int d = min(cols, vec.get_the_size());
+    for(int j = 0; j < d; j++)
+    {
+        r[j] = vec.get_element(j);
+    }
+    fill(r + d, r + stride, (scalar_t)0);
+    storage->norms.push_back(distance_kernels::best().dot(r, r, stride));
+    rows++;
+}
+
+/**
+ * @fn bool VectorDataset::delete_vector(int i)
+ * @brief Marks the vector at a given index as deleted, in constant time.
+ *
+ * The bitmap has room for every row the storage can hold, so it never
+ * moves under a reader.
+ *
+ * @param i The index.
+ * @return False if there is no such vector or it was already deleted.
+ */
+bool VectorDataset::delete_vector(int i)
+{
+    if(i < 0 || i >= rows || is_deleted(i))
+    {
+        return false;
+    }
+
+    __atomic_fetch_or(&storage->tombstones[i >> 6], 1ULL << (i & 63), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&deleted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @fn void VectorDataset::print_datavector()
+ * @brief Prints the vectors in the dataset.
+ */
+void VectorDataset::print_datavector()
+{
+    for(int i = 0; i < rows; i++)
+    {
+        row(i).print_vector();
+    }
+}
+
+/**
+ * @fn bool VectorDataset::WriteDeleted(const char* path)
+ * @brief Writes the indices of the deleted vectors, one per line.
+ *
+ * Like WriteBinary it writes a temporary file and renames it over path.
+ *
+ * @param path The file.
+ * @return False if the file could not be written.
+ */
+bool VectorDataset::WriteDeleted(const char* path)
+{
+    string temp_path = string(path) + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "w");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    for(int i = 0; i < rows && ok; i++)
+    {
+        if(is_deleted(i))
+        {
+            ok = fprintf(file, "%d\n", i) > 0;
+        }
+    }
+    ok = fflush(file) == 0 && ok;
+#ifndef _WIN32
+    ok = fsync(fileno(file)) == 0 && ok;
+#endif
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok)
+    {
+        remove(temp_path.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(temp_path.c_str(), path) == 0;
+}
+
+/**
+ * @fn static uint32_t crc32(const void* data, size_t size, uint32_t crc)
+ * @brief Extends a CRC-32 (IEEE 802.3) over more bytes, starting from 0.
+ *
+ * Eight bytes are folded in at a time through eight tables, the slicing
+ * by 8 method, which keeps up with checksumming a whole dataset. Words are
+ * read little-endian, like every file this program writes.
+ */
+static uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+{
+    static const array<array<uint32_t, 256>, 8> table = []()
+    {
+        array<array<uint32_t, 256>, 8> t;
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for(int j = 0; j < 8; j++)
+            {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            t[0][i] = c;
+        }
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            for(int k = 1; k < 8; k++)
+            {
+                t[k][i] = t[0][t[k - 1][i] & 0xff] ^ (t[k - 1][i] >> 8);
+            }
+        }
+        return t;
+    }();
+
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    for(; size >= 8; p += 8, size -= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+            ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for(size_t i = 0; i < size; i++)
+    {
+        crc = table[0][(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * @fn static uint32_t record_checksum(const log_record& record, const void* payload)
+ * @brief Computes the checksum a record must carry.
+ */
+static uint32_t record_checksum(const log_record& record, const void* payload)
+{
+    return crc32(payload, record.length, crc32(&record.type, sizeof(record) - sizeof(record.checksum)));
+}
+
+/**
+ * @fn static bool replay_record(const log_record& record, const vector<char>& payload, VectorDataset& data)
+ * @brief Applies a logged change to a dataset.
+ * @return False if the record does not follow from the dataset.
+ */
+static bool replay_record(const log_record& record, const vector<char>& payload, VectorDataset& data)
+{
+    if(record.type == log_delete)
+    {
+        // Deleting again what the checkpoint already deleted changes nothing
+        if(record.id < 0 || record.id >= data.row_size())
+        {
+            return false;
+        }
+        data.delete_vector(record.id);
+        return true;
+    }
+
+    if(record.type != log_insert || record.id > data.row_size() || record.length % sizeof(scalar_t) != 0)
+    {
+        return false;
+    }
+    if(record.id < data.row_size())
+    {
+        return true;
+    }
+
+    const scalar_t* values = (const scalar_t*)payload.data();
+    DataVector row(0);
+    for(size_t j = 0; j < record.length / sizeof(scalar_t); j++)
+    {
+        row.input(values[j]);
+    }
+    data.add_vector(row);
+    return true;
+}
+
+MutationLog::MutationLog(const string& path, FILE* file, size_t bytes) : path(path), file(file), appended(0), durable(0), flushing(false), bytes(bytes)
+{
+}
+
+MutationLog::~MutationLog()
+{
+    fclose(file);
+}
+
+/**
+ * @fn static unique_ptr<MutationLog> MutationLog::open(const char* path, VectorDataset& data)
+ * @brief Replays a log on top of a dataset and opens it for appending.
+ *
+ * Replay stops at the first record that is torn or does not follow from
+ * the dataset, and the log is cut there. Inserts the dataset already has
+ * are skipped, so a log that outlived its checkpoint is harmless.
+ *
+ * @param path The log file, created if it does not exist.
+ * @param data The dataset as of the last checkpoint.
+ * @return The log, or NULL if it could not be opened.
+ */
+unique_ptr<MutationLog> MutationLog::open(const char* path, VectorDataset& data)
+{
+    FILE* file = fopen(path, "r+b");
+    if(file == NULL)
+    {
+        file = fopen(path, "w+b");
+    }
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    log_header header;
+    size_t valid = 0;
+    int replayed = 0;
+    if(fread(&header, sizeof(header), 1, file) == 1)
+    {
+        if(memcmp(header.magic, "KNNWAL\0", 8) != 0 || header.version != log_format_version || header.dtype != sizeof(scalar_t))
+        {
+            printf("%s is not a mutation log of this version\n", path);
+            fclose(file);
+            return NULL;
+        }
+        valid = sizeof(header);
+
+        log_record record;
+        vector<char> payload;
+        while(fread(&record, sizeof(record), 1, file) == 1 && record.length <= (1u << 30))
+        {
+            payload.resize(record.length);
+            if(fread(payload.data(), 1, record.length, file) != record.length
+                || record_checksum(record, payload.data()) != record.checksum
+                || !replay_record(record, payload, data))
+            {
+                break;
+            }
+            valid += sizeof(record) + record.length;
+            replayed++;
+        }
+    }
+
+    unique_ptr<MutationLog> log(new MutationLog(path, file, valid));
+    if(valid == 0)
+    {
+        // A new log, or one whose header never made it to disk
+        if(!log->reset())
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        // Whatever follows the last good record was torn by a crash
+        fflush(file);
+#ifndef _WIN32
+        if(ftruncate(fileno(file), valid) != 0)
+        {
+            return NULL;
+        }
+#endif
+        fseek(file, valid, SEEK_SET);
+    }
+
+    if(replayed > 0)
+    {
+        printf("Replayed %d changes from %s\n", replayed, path);
+    }
+    return log;
+}
+
+/**
+ * @fn bool MutationLog::reset()
+ * @brief Replaces the file with an empty log. The caller holds the lock.
+ * @return False if the file could not be written, the old one is then kept.
+ */
+bool MutationLog::reset()
+{
+    log_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "KNNWAL\0", 8);
+    header.version = log_format_version;
+    header.dtype = sizeof(scalar_t);
+
+    FILE* fresh = fopen(path.c_str(), "w+b");
+    if(fresh == NULL)
+    {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fresh) == 1 && fflush(fresh) == 0;
+#ifndef _WIN32
+    ok = ok && fsync(fileno(fresh)) == 0;
+#endif
+    if(!ok)
+    {
+        fclose(fresh);
+        return false;
+    }
+
+    if(file != NULL)
+    {
+        fclose(file);
+    }
+    file = fresh;
+    bytes = sizeof(header);
+    return true;
+}
+
+/**
+ * @fn uint64_t MutationLog::append(uint32_t type, int id, const void* payload, uint32_t length)
+ * @brief Adds a record to the ones waiting to be written.
+ * @return The sequence number of the record.
+ */
+uint64_t MutationLog::append(uint32_t type, int id, const void* payload, uint32_t length)
+{
+    log_record record;
+    record.type = type;
+    record.id = id;
+    record.length = length;
+    record.checksum = record_checksum(record, payload);
+
+    lock_guard<mutex> guard(lock);
+    pending.insert(pending.end(), (const char*)&record, (const char*)&record + sizeof(record));
+    pending.insert(pending.end(), (const char*)payload, (const char*)payload + length);
+    return ++appended;
+}
+
+/**
+ * @fn uint64_t MutationLog::log_insert_row(int id, RowView row)
+ * @brief Appends the insertion of a row.
+ * @param id The index of the row.
+ * @param row The row.
+ * @return The sequence number to commit.
+ */
+uint64_t MutationLog::log_insert_row(int id, RowView row)
+{
+    return append(log_insert, id, row.data(), row.get_the_size() * sizeof(scalar_t));
+}
+
+/**
+ * @fn uint64_t MutationLog::log_delete_row(int id)
+ * @brief Appends the deletion of a row.
+ * @param id The index of the row.
+ * @return The sequence number to commit.
+ */
+uint64_t MutationLog::log_delete_row(int id)
+{
+    return append(log_delete, id, NULL, 0);
+}
+
+/**
+ * @fn bool MutationLog::commit(uint64_t sequence)
+ * @brief Waits until every record up to a sequence number is on disk.
+ *
+ * The thread that finds no write in progress writes everything appended
+ * so far and flushes it with one fsync. Threads that arrive meanwhile wait,
+ * and usually find their records written along with it.
+ *
+ * @param sequence The sequence number.
+ * @return False if the log could not be written.
+ */
+bool MutationLog::commit(uint64_t sequence)
+{
+    unique_lock<mutex> guard(lock);
+    while(durable < sequence)
+    {
+        if(flushing)
+        {
+            flushed.wait(guard);
+            continue;
+        }
+
+        flushing = true;
+        vector<char> batch;
+        batch.swap(pending);
+        uint64_t last = appended;
+        guard.unlock();
+
+        bool ok = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && fflush(file) == 0;
+#ifndef _WIN32
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+
+        guard.lock();
+        flushing = false;
+        flushed.notify_all();
+        if(!ok)
+        {
+            // The records go back in front, the next commit tries them again
+            pending.insert(pending.begin(), batch.begin(), batch.end());
+            return false;
+        }
+        bytes += batch.size();
+        durable = last;
+    }
+    return true;
+}
+
+/**
+ * @fn bool MutationLog::checkpoint(VectorDataset& data, const char* bin_path, const char* deleted_path)
+ * @brief Writes the dataset to its files and empties the log.
+ *
+ * Changes are applied to the dataset before they are logged, so the files
+ * hold every record written so far. A crash before the log is emptied
+ * replays it on top of the new files, which skips what they already have.
+ * Records still waiting to be written stay for the new log.
+ *
+ * @param data The dataset.
+ * @param bin_path The binary dataset file.
+ * @param deleted_path The list of deleted rows.
+ * @return False if a file could not be written, the log is then kept.
+ */
+bool MutationLog::checkpoint(VectorDataset& data, const char* bin_path, const char* deleted_path)
+{
+    unique_lock<mutex> guard(lock);
+    flushed.wait(guard, [this]() { return !flushing; });
+
+    if(!data.WriteBinary(bin_path) || !data.WriteDeleted(deleted_path))
+    {
+        return false;
+    }
+    return reset();
+}
+
+/**
+ * @fn size_t MutationLog::size()
+ * @brief Gets the size of the log file, records not yet written included.
+ * @return The size in bytes.
+ */
+size_t MutationLog::size()
+{
+    lock_guard<mutex> guard(lock);
+    return bytes + pending.size();
+}
+
+/**
+ * @fn static bool same_rows(VectorDataset& a, VectorDataset& b)
+ * @brief Checks that two datasets hold the same rows and tombstones.
+ */
+static bool same_rows(VectorDataset& a, VectorDataset& b)
+{
+    if(a.row_size() != b.row_size() || a.dimension() != b.dimension())
+    {
+        return false;
+    }
+    for(int i = 0; i < a.row_size(); i++)
+    {
+        if(a.is_deleted(i) != b.is_deleted(i))
+        {
+            return false;
+        }
+        for(int j = 0; j < a.dimension(); j++)
+        {
+            if(a.access_element(i, j) != b.access_element(i, j))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @fn static vector<char> read_bytes(const char* path)
+ * @brief Reads a whole file, or nothing if it cannot be opened.
+ */
+static vector<char> read_bytes(const char* path)
+{
+    vector<char> bytes;
+    FILE* file = fopen(path, "rb");
+    if(file != NULL)
+    {
+        char buffer[4096];
+        size_t got;
+        while((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            bytes.insert(bytes.end(), buffer, buffer + got);
+        }
+        fclose(file);
+    }
+    return bytes;
+}
+
+/**
+ * @fn static bool write_bytes(const char* path, const vector<char>& bytes)
+ * @brief Replaces a file with the given bytes.
+ * @return False if the file could not be written.
+ */
+static bool write_bytes(const char* path, const vector<char>& bytes)
+{
+    FILE* file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return file != NULL && fclose(file) == 0 && written;
+}
+
+/**
+ * @fn static bool check_log_replay()
+ * @brief Replays a small mutation log whole, with a torn last record and with a corrupt one.
+ *
+ * The log is written to treeindex-check.wal in the working directory and
+ * removed afterwards. Three inserts and a delete are logged on top of a
+ * four-row checkpoint. Replaying them must give the same rows. Cutting
+ * the delete short, or changing a byte of it, must give the rows before
+ * it, and leave a log that later records can be appended to.
+ *
+ * @return True if every replay gave the expected rows.
+ */
+static bool check_log_replay()
+{
+    const char* path = "treeindex-check.wal";
+    auto checkpoint = [](VectorDataset& data)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            DataVector row(0);
+            for(int j = 0; j < 8; j++)
+            {
+                row.input(i * 8 + j);
+            }
+            data.add_vector(row);
+        }
+    };
+    auto replay = [&](VectorDataset& data)
+    {
+        checkpoint(data);
+        return MutationLog::open(path, data);
+    };
+
+    auto inserted = [&](VectorDataset& data, int deleted)
+    {
+        checkpoint(data);
+        for(int i = 4; i < 7; i++)
+        {
+            DataVector row(0);
+            for(int j = 0; j < 8; j++)
+            {
+                row.input(-i * j);
+            }
+            data.add_vector(row);
+        }
+        if(deleted >= 0)
+        {
+            data.delete_vector(deleted);
+        }
+    };
+
+    // The rows as logged, and as the torn and corrupt logs must leave them
+    VectorDataset logged, before_delete, appended_delete;
+    inserted(logged, 1);
+    inserted(before_delete, -1);
+    inserted(appended_delete, 2);
+
+    VectorDataset start;
+    remove(path);
+    unique_ptr<MutationLog> log = replay(start);
+    bool ok = log != NULL;
+    for(int i = 4; ok && i < 7; i++)
+    {
+        ok = log->commit(log->log_insert_row(i, logged.row(i)));
+    }
+    ok = ok && log->commit(log->log_delete_row(1));
+    log.reset();
+
+    vector<char> whole = read_bytes(path);
+    if(!ok || whole.size() <= sizeof(log_record))
+    {
+        remove(path);
+        printf("Cannot write the mutation log %s\n", path);
+        return false;
+    }
+
+    // The whole log
+    VectorDataset full;
+    log = replay(full);
+    bool replayed = log != NULL && same_rows(full, logged);
+    log.reset();
+
+    // The delete cut short, as a crash in the middle of its write leaves it
+    vector<char> torn_bytes(whole.begin(), whole.end() - 3);
+    VectorDataset torn;
+    log = write_bytes(path, torn_bytes) ? replay(torn) : NULL;
+    bool torn_ok = log != NULL && same_rows(torn, before_delete);
+
+    // The cut log takes new records after the last good one
+    torn_ok = torn_ok && log->commit(log->log_delete_row(2));
+    log.reset();
+    VectorDataset appended;
+    log = torn_ok ? replay(appended) : NULL;
+    torn_ok = log != NULL && same_rows(appended, appended_delete);
+    log.reset();
+
+    // The delete with a byte of its checksum changed
+    vector<char> corrupt_bytes = whole;
+    corrupt_bytes[whole.size() - sizeof(log_record)] ^= 1;
+    VectorDataset corrupt;
+    log = write_bytes(path, corrupt_bytes) ? replay(corrupt) : NULL;
+    bool corrupt_ok = log != NULL && same_rows(corrupt, before_delete);
+    log.reset();
+    remove(path);
+
+    printf("Mutation log replay: whole %s, torn %s, corrupt %s\n", replayed ? "ok" : "wrong", torn_ok ? "ok" : "wrong", corrupt_ok ? "ok" : "wrong");
+    return replayed && torn_ok && corrupt_ok;
+}
+
+shared_ptr<VectorDataset> TreeIndex::dataset;
+
+unique_ptr<MutationLog> TreeIndex::mutation_log;
+
+size_t TreeIndex::checkpoint_bytes = (size_t)64 << 20;
+
+/**
+ * @fn static shared_ptr<VectorDataset> TreeIndex::SharedDataset()
+ * @brief Gives the shared training set, reading it on the first call.
+ * @return The shared training set, or NULL if it could not be read.
+ */
+shared_ptr<VectorDataset> TreeIndex::SharedDataset()
+{
+    // The first callers may come from several threads, only one of them reads and replays
+    static once_flag loaded;
+    call_once(loaded, []()
+    {
+        // Without its files the log must not be replayed, let alone checkpointed over them
+        shared_ptr<VectorDataset> temp = make_shared<VectorDataset>();
+        if(!temp->ReadDataset())
+        {
+            return;
+        }
+
+        // The changes since the last checkpoint are replayed on top of it
+        mutation_log = MutationLog::open("fmnist-train.wal", *temp);
+        if(mutation_log == NULL)
+        {
+            printf("Cannot open the mutation log, changes will not be saved\n");
+        }
+
+        // The dimension comes from the data rather than being fixed in advance
+        if(temp->dimension() > 0)
+        {
+            max_cols = temp->dimension();
+        }
+        dataset = temp;
+    });
+    return dataset;
+}
+
+// Rows sampled to estimate the variance of every dimension
+static const int order_sample_size = 1024;
+
+/**
+ * @fn static vector<int> block_order(const dataset_snapshot& data, bool by_variance)
+ * @brief Lists the offsets of the blocks of a row that hold data.
+ *
+ * By variance, the blocks whose dimensions vary the most across a sample
+ * of rows come first. Distances are mostly made of those dimensions, so
+ * summing them first lets a losing candidate be abandoned early.
+ */
+static vector<int> block_order(const dataset_snapshot& data, bool by_variance)
+{
+    int block = distance_kernels::block;
+    int blocks = (data.cols + block - 1) / block;
+    vector<int> order(blocks);
+    for(int c = 0; c < blocks; c++)
+    {
+        order[c] = c * block;
+    }
+
+    int n = data.rows;
+    if(!by_variance || n == 0)
+    {
+        return order;
+    }
+
+    vector<double> spread(blocks, 0.0);
+    int samples = min(n, order_sample_size);
+    for(int j = 0; j < data.cols; j++)
+    {
+        double sum = 0, squares = 0;
+        for(int t = 0; t < samples; t++)
+        {
+            double x = data.row((long long)t * n / samples).get_element(j);
+            sum += x;
+            squares += x * x;
+        }
+        spread[j / block] += squares - sum * sum / samples;
+    }
+
+    stable_sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        return spread[a / block] > spread[b / block];
+    });
+    return order;
+}
+
+/**
+ * @fn static shared_ptr<VectorDataset> indexed_dataset()
+ * @brief Gives the shared training set, or an empty one if it could not
+ * be read, so that an index never refers to a missing dataset.
+ */
+static shared_ptr<VectorDataset> indexed_dataset()
+{
+    shared_ptr<VectorDataset> data = TreeIndex::SharedDataset();
+    return data != NULL ? data : make_shared<VectorDataset>();
+}
+
+TreeIndex::TreeIndex() : data(indexed_dataset()), D(*data), view(D.snapshot()), scan_order(block_order(view, reorder_dimensions)), deleted_at_build(data->deleted_count())
+{
+}
+
+/**
+ * @fn bool TreeIndex::needs_compaction(int rows) const
+ * @brief Checks whether enough of an index is deleted to rebuild it.
+ * @param rows The number of rows of the training set the index covers.
+ * @return True once the deleted share passes compaction_threshold.
+ */
+bool TreeIndex::needs_compaction(int rows) const
+{
+    int dead = D.deleted_count() - deleted_at_build;
+    return dead > 0 && dead > compaction_threshold * (rows - deleted_at_build);
+}
+
+// Rows checksummed together by one task of the fingerprint, fixed so that
+// the fingerprint does not depend on the number of threads
+static const int fingerprint_rows = 1024;
+
+/**
+ * @fn static uint32_t dataset_fingerprint(const dataset_snapshot& data, int rows)
+ * @brief Checksums the first rows of a dataset.
+ *
+ * Every row is read, so an index never loads over a dataset whose rows
+ * were edited, which would silently return wrong neighbours. The rows are
+ * checksummed in pieces on the shared pool, then the piece checksums are.
+ */
+static uint32_t dataset_fingerprint(const dataset_snapshot& data, int rows)
+{
+    int pieces = (rows + fingerprint_rows - 1) / fingerprint_rows;
+    vector<uint32_t> crcs(pieces);
+
+    TaskGroup group;
+    for(int p = 0; p < pieces; p++)
+    {
+        group.run([&data, &crcs, rows, p]()
+        {
+            uint32_t crc = 0;
+            for(int i = p * fingerprint_rows; i < min(rows, (p + 1) * fingerprint_rows); i++)
+            {
+                RowView r = data.row(i);
+                crc = crc32(r.data(), sizeof(scalar_t) * r.get_the_size(), crc);
+            }
+            crcs[p] = crc;
+        });
+    }
+    group.wait();
+
+    return crc32(crcs.data(), crcs.size() * sizeof(uint32_t), crc32(&rows, sizeof(rows)));
+}
+
+/**
+ * @fn static index_header new_index_header(const dataset_snapshot& data, uint32_t kind, int leaf_size, int trees, bool sparse, int indexed, int deleted)
+ * @brief Fills the header of an index about to be saved, all but the checksum.
+ */
+static index_header new_index_header(const dataset_snapshot& data, uint32_t kind, int leaf_size, int trees, bool sparse, int indexed, int deleted)
+{
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "KNNINDX", 8);
+    header.version = index_format_version;
+    header.kind = kind;
+    header.dtype = sizeof(scalar_t);
+    header.cols = data.cols;
+    header.stride = data.stride;
+    header.leaf_size = leaf_size;
+    header.trees = trees;
+    header.indexed = indexed;
+    header.deleted = deleted;
+    header.fingerprint = dataset_fingerprint(data, indexed);
+    header.sparse = sparse;
+    return header;
+}
+
+/**
+ * @fn static bool write_section(FILE* file, const void* data, size_t bytes, uint32_t& crc)
+ * @brief Writes the next bytes of a saved index, extending its checksum.
+ */
+static bool write_section(FILE* file, const void* data, size_t bytes, uint32_t& crc)
+{
+    crc = crc32(data, bytes, crc);
+    return bytes == 0 || fwrite(data, bytes, 1, file) == 1;
+}
+
+template<class T>
+static bool write_array(FILE* file, const pmr::vector<T>& v, uint32_t& crc)
+{
+    return write_section(file, v.data(), v.size() * sizeof(T), crc);
+}
+
+template<class T>
+static bool write_array(FILE* file, const shared_blocks<T>& v, uint32_t& crc)
+{
+    // The rows of a block are contiguous, the file does not see the blocks
+    for(size_t i = 0; i < v.size(); i += v.block_rows())
+    {
+        size_t rows = min(v.block_rows(), v.size() - i);
+        if(!write_section(file, v.row(i), rows * v.row_width() * sizeof(T), crc))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @fn static bool write_index(const char* path, index_header& header, const function<bool(FILE*, uint32_t&)>& write_trees)
+ * @brief Writes a saved index to a temporary file and renames it over path.
+ * @param path The index file.
+ * @param header The header, completed here with the checksum.
+ * @param write_trees Writes the tree sections, extending the checksum.
+ * @return False if the file could not be written.
+ */
+static bool write_index(const char* path, index_header& header, const function<bool(FILE*, uint32_t&)>& write_trees)
+{
+    string temp_path = string(path) + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    // The checksum is only known at the end, so the header is written twice
+    uint32_t crc = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && write_trees(file, crc);
+    header.checksum = crc;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fflush(file) == 0 && ok;
+#ifndef _WIN32
+    ok = fsync(fileno(file)) == 0 && ok;
+#endif
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok)
+    {
+        remove(temp_path.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(temp_path.c_str(), path) == 0;
+}
+
+/**
+ * @fn static FILE* open_index(const char* path, VectorDataset& data, uint32_t kind, int leaf_size, int trees, bool sparse, index_header& header, size_t& remaining)
+ * @brief Opens a saved index and checks that it was built over this dataset with these options.
+ * @param header The header read.
+ * @param remaining The number of bytes after the header.
+ * @return The file, positioned after the header, or NULL.
+ */
+static FILE* open_index(const char* path, VectorDataset& data, uint32_t kind, int leaf_size, int trees, bool sparse, index_header& header, size_t& remaining)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    long size = -1;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && fseek(file, 0, SEEK_END) == 0
+        && (size = ftell(file)) >= (long)sizeof(header) && fseek(file, sizeof(header), SEEK_SET) == 0;
+    if(!ok || memcmp(header.magic, "KNNINDX", 8) != 0 || header.version != index_format_version || header.kind != kind)
+    {
+        printf("%s is not an index of this kind and version\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    // Rows deleted at the build are not in the index, so none of them may have come back
+    if(header.dtype != sizeof(scalar_t) || header.cols != (uint32_t)data.dimension() || header.stride != (uint32_t)data.row_stride()
+        || header.indexed > (uint32_t)data.row_size() || header.deleted > (uint32_t)data.deleted_count()
+        || header.fingerprint != dataset_fingerprint(data.snapshot(), header.indexed)
+        || header.leaf_size != (uint32_t)leaf_size || header.trees != (uint32_t)trees || header.sparse != (uint32_t)sparse)
+    {
+        printf("%s was saved for another dataset or with other options\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    remaining = size - sizeof(header);
+    return file;
+}
+
+/**
+ * @fn static bool read_section(FILE* file, void* data, size_t bytes, size_t& remaining, uint32_t& crc)
+ * @brief Reads the next bytes of a saved index, extending its checksum.
+ */
+static bool read_section(FILE* file, void* data, size_t bytes, size_t& remaining, uint32_t& crc)
+{
+    if(bytes > remaining || (bytes > 0 && fread(data, bytes, 1, file) != 1))
+    {
+        return false;
+    }
+    remaining -= bytes;
+    crc = crc32(data, bytes, crc);
+    return true;
+}
+
+template<class T>
+static bool read_array(FILE* file, pmr::vector<T>& v, uint64_t count, size_t& remaining, uint32_t& crc)
+{
+    // A damaged count must not allocate more than the file holds
+    if(count > remaining / sizeof(T))
+    {
+        return false;
+    }
+    v.resize(count);
+    return read_section(file, v.data(), count * sizeof(T), remaining, crc);
+}
+
+template<class T>
+static bool read_array(FILE* file, shared_blocks<T>& v, uint64_t count, size_t& remaining, uint32_t& crc)
+{
+    size_t row_bytes = v.row_width() * sizeof(T);
+    if(count > remaining / row_bytes)
+    {
+        return false;
+    }
+    v.resize(count);
+    for(size_t i = 0; i < count; i += v.block_rows())
+    {
+        size_t rows = min(v.block_rows(), (size_t)count - i);
+        if(!read_section(file, v.write_row(i), rows * row_bytes, remaining, crc))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @fn static bool valid_tree(const shared_blocks<flat_node>& nodes, const shared_blocks<int>& ids, const pmr::vector<int>& spare_pairs, int axes, int indexed)
+ * @brief Checks that a tree read from a saved index only refers to what it has.
+ *
+ * The checksum catches damage, this catches a file that was written wrong.
+ * Every node reachable from the root must be reached once, with its
+ * children, its leaf range and its axis in bounds, and every point in the
+ * leaves must be a row the index covers.
+ *
+ * @param axes One past the largest axis, the columns or the projection ids.
+ * @param indexed The number of rows the index covers.
+ */
+static bool valid_tree(const shared_blocks<flat_node>& nodes, const shared_blocks<int>& ids, const pmr::vector<int>& spare_pairs, int axes, int indexed)
+{
+    for(int pair : spare_pairs)
+    {
+        if(pair < 1 || (size_t)pair + 1 >= nodes.size())
+        {
+            return false;
+        }
+    }
+
+    // A child that points back up the tree would send searches round in circles
+    vector<char> seen(nodes.size(), 0);
+    vector<int> stack(1, 0);
+    seen[0] = 1;
+    while(!stack.empty())
+    {
+        const flat_node& temp = nodes[stack.back()];
+        stack.pop_back();
+
+        if(temp.is_leaf())
+        {
+            if(temp.child < 0 || (size_t)temp.child + temp.leaf_count() > ids.size())
+            {
+                return false;
+            }
+            for(int i = temp.child; i < temp.child + temp.leaf_count(); i++)
+            {
+                if(ids[i] < 0 || ids[i] >= indexed)
+                {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if(temp.axis >= axes || temp.child < 1 || (size_t)temp.child + 1 >= nodes.size() || seen[temp.child] || seen[temp.child + 1])
+        {
+            return false;
+        }
+        seen[temp.child] = seen[temp.child + 1] = 1;
+        stack.push_back(temp.child);
+        stack.push_back(temp.child + 1);
+    }
+    return true;
+}
+
+/**
+ * @fn static void checkpoint_when_due(VectorDataset& data)
+ * @brief Folds the mutation log back into the dataset files once it is large.
+ */
+static void checkpoint_when_due(VectorDataset& data)
+{
+    if(TreeIndex::mutation_log == NULL || TreeIndex::mutation_log->size() <= TreeIndex::checkpoint_bytes)
+    {
+        return;
+    }
+
+    shared_lock<shared_mutex> layout(TreeIndex::layout_lock);
+    if(TreeIndex::mutation_log->checkpoint(data, "fmnist-train.bin", "fmnist-train.deleted"))
+    {
+        printf("Checkpoint written to fmnist-train.bin\n");
+    }
+    else
+    {
+        printf("Checkpoint failed, the mutation log is kept\n");
+    }
+}
+
+/**
+ * @fn int TreeIndex::add_datavector(DataVector vec)
+ * @brief Adds a vector to the shared training set and logs it.
+ *
+ * Only the new row is written, to the mutation log. The dataset files are
+ * brought up to date by the next checkpoint. The row is logged before any
+ * other writer can add one, so the log keeps the order of the rows.
+ *
+ * @param vec The vector to add.
+ * @return The index of the new vector, or -1 if it was rejected.
+ */
+int TreeIndex::add_datavector(DataVector temp)
+{
+    int d = temp.get_the_size();
+
+    if(d > max_cols)
+    {
+        printf("Dimension exceeds the maximum dimension\n");
+        return -1;
+    }
+
+    // The rows may move as they grow, so this waits for a rebuild running in the background
+    int id;
+    uint64_t sequence = 0;
+    {
+        unique_lock<shared_mutex> layout(layout_lock);
+        D.add_vector(temp);
+        id = D.row_size() - 1;
+        if(mutation_log != NULL)
+        {
+            sequence = mutation_log->log_insert_row(id, D.row(id));
+        }
+    }
+
+    if(mutation_log != NULL && !mutation_log->commit(sequence))
+    {
+        cout << "Failed to write the mutation log." << endl;
+        return id; // The vector is in memory even if it is not saved
+    }
+
+    checkpoint_when_due(D);
+    return id;
+}
+
+/**
+ * @fn bool TreeIndex::delete_datavector(int d)
+ * @brief Deletes a vector from the shared training set and logs it.
+ *
+ * The vector is only marked, so every other vector keeps its index and
+ * searches already running are not disturbed. The indexes skip it from
+ * now on and drop it when they are next compacted.
+ *
+ * @param d The index of the vector.
+ * @return False if there is no vector with that index.
+ */
+bool TreeIndex::delete_datavector(int d)
+{
+    uint64_t sequence = 0;
+    {
+        shared_lock<shared_mutex> layout(layout_lock);
+        if(d < 0 || d >= D.row_size())
+        {
+            printf("Index exceeds the maximum index\n");
+            return false;
+        }
+
+        if(!D.delete_vector(d))
+        {
+            printf("Vector %d is already deleted\n", d);
+            return false;
+        }
+
+        if(mutation_log != NULL)
+        {
+            sequence = mutation_log->log_delete_row(d);
+        }
+    }
+
+    if(mutation_log != NULL && !mutation_log->commit(sequence))
+    {
+        cout << "Failed to write the mutation log." << endl;
+        return true; // The vector is gone from memory even if that is not saved
+    }
+
+    checkpoint_when_due(D);
+    return true;
+}
+
+int KDTreeIndex::leaf_size = 32;
+int KDTreeIndex::max_checks = 0;
+int RPTreeIndex::leaf_size = 32;
+int RPTreeIndex::trees = 1;
+bool RPTreeIndex::sparse_projections = false;
+unsigned RPTreeIndex::seed = 0;
+const char* KDTreeIndex::index_path = NULL;
+const char* RPTreeIndex::index_path = NULL;
+
+/**
+ * @fn static int subtree_nodes(int n, int leaf)
+ * @brief Counts the nodes of a tree over n points.
+ *
+ * Every node splits its points in half until at most leaf of them are left,
+ * so the shape of a tree depends on nothing but n.
+ */
+static int subtree_nodes(int n, int leaf)
+{
+    if(n <= leaf)
+    {
+        return 1;
+    }
+    return 1 + subtree_nodes(n / 2, leaf) + subtree_nodes(n - n / 2, leaf);
+}
+
+int TreeIndex::sample_median_above = 1 << 16;
+
+int TreeIndex::parallel_cutoff = 2048;
+
+bool TreeIndex::reorder_dimensions = true;
+
+bool TreeIndex::norm_distances = false;
+
+double TreeIndex::compaction_threshold = 0.1;
+
+// Number of points the pivots of a large node are chosen from, and how far
+// on either side of the sample median they are taken
+static const int median_sample_size = 1023;
+static const int median_band = 32;
+
+/**
+ * @fn static int build_chunks(int n)
+ * @brief Decides how many chunks the work inside a node of n points is split into.
+ * @return 1 unless the node is large enough to spread over the shared pool.
+ */
+static int build_chunks(int n)
+{
+    ThreadPool& pool = ThreadPool::shared();
+    if(pool.size() <= 1 || n <= 8 * TreeIndex::parallel_cutoff)
+    {
+        return 1;
+    }
+    return pool.size() * 4;
+}
+
+/**
+ * @fn static void for_chunks(int n, int chunks, const function<void(int, int, int)>& body)
+ * @brief Calls body(c, begin, end) for chunks equal pieces of [0, n), as tasks on the shared pool.
+ */
+static void for_chunks(int n, int chunks, const function<void(int, int, int)>& body)
+{
+    if(chunks <= 1)
+    {
+        body(0, 0, n);
+        return;
+    }
+
+    TaskGroup group;
+    for(int c = 1; c < chunks; c++)
+    {
+        int b = (long long)n * c / chunks;
+        int e = (long long)n * (c + 1) / chunks;
+        group.run([&body, c, b, e]() { body(c, b, e); });
+    }
+    body(0, 0, n / chunks);
+    group.wait();
+}
+
+/**
+ * @fn static double split_at_median(pair<double, int>* v, int n, pair<double, int>* spare, int chunks)
+ * @brief Moves the n / 2 smallest values of v in front of the others.
+ *
+ * This is a linear time selection rather than a sort. Nodes larger than
+ * TreeIndex::sample_median_above first take two pivots just below and just
+ * above the median of an evenly spaced sample and split v three ways
+ * around them, so the selection almost always only runs on the thin band
+ * between the pivots. With more than one chunk the three-way split runs in
+ * parallel through spare, which must hold n entries.
+ *
+ * @return The median, halfway between the largest lower value and the
+ * smallest upper one.
+ */
+static double split_at_median(pair<double, int>* v, int n, pair<double, int>* spare, int chunks)
+{
+    auto by_value = [](const pair<double, int>& a, const pair<double, int>& b)
+    {
+        return a.first < b.first;
+    };
+
+    int mid = n / 2;
+    if(TreeIndex::sample_median_above <= 0 || n <= TreeIndex::sample_median_above || n <= median_sample_size)
+    {
+        nth_element(v, v + mid, v + n, by_value);
+        return (max_element(v, v + mid, by_value)->first + v[mid].first) / 2;
+    }
+
+    double sample[median_sample_size];
+    for(int i = 0; i < median_sample_size; i++)
+    {
+        sample[i] = v[(size_t)i * n / median_sample_size].first;
+    }
+    sort(sample, sample + median_sample_size);
+    double low = sample[median_sample_size / 2 - median_band];
+    double high = sample[median_sample_size / 2 + median_band];
+
+    // Below low, then from low to high, then above high
+    int p1, p2;
+    if(chunks <= 1)
+    {
+        p1 = partition(v, v + n, [low](const pair<double, int>& a) { return a.first < low; }) - v;
+        p2 = partition(v + p1, v + n, [high](const pair<double, int>& a) { return a.first <= high; }) - v;
+    }
+    else
+    {
+        // Every chunk counts its three groups, then copies them to their final place in spare
+        vector<int> below(chunks + 1, 0), within(chunks + 1, 0), above(chunks + 1, 0);
+        for_chunks(n, chunks, [&](int c, int b, int e)
+        {
+            for(int i = b; i < e; i++)
+            {
+                below[c + 1] += v[i].first < low;
+                within[c + 1] += v[i].first >= low && v[i].first <= high;
+            }
+            above[c + 1] = (e - b) - below[c + 1] - within[c + 1];
+        });
+        for(int c = 0; c < chunks; c++)
+        {
+            below[c + 1] += below[c];
+            within[c + 1] += within[c];
+            above[c + 1] += above[c];
+        }
+        p1 = below[chunks];
+        p2 = p1 + within[chunks];
+
+        for_chunks(n, chunks, [&](int c, int b, int e)
+        {
+            int x = below[c], y = p1 + within[c], z = p2 + above[c];
+            for(int i = b; i < e; i++)
+            {
+                if(v[i].first < low)
+                {
+                    spare[x++] = v[i];
+                }
+                else if(v[i].first <= high)
+                {
+                    spare[y++] = v[i];
+                }
+                else
+                {
+                    spare[z++] = v[i];
+                }
+            }
+        });
+        for_chunks(n, chunks, [&](int c, int b, int e)
+        {
+            copy(spare + b, spare + e, v + b);
+        });
+    }
+
+    int s0 = mid < p1 ? 0 : (mid < p2 ? p1 : p2);
+    int s1 = mid < p1 ? p1 : (mid < p2 ? p2 : n);
+    nth_element(v + s0, v + mid, v + s1, by_value);
+
+    // Everything before s0 is below the group holding mid
+    double lower = mid > s0 ? max_element(v + s0, v + mid, by_value)->first : max_element(v, v + s0, by_value)->first;
+    return (lower + v[mid].first) / 2;
+}
+
+/**
+ * @fn static void breadth_first(pmr::vector<flat_node>& tree, pmr::memory_resource* scratch_arena)
+ * @brief Reorders a tree built depth-first into breadth-first order, in place.
+ *
+ * The builders place the left child of a node right after it and keep the
+ * right child in child. Afterwards the root is at 0, the children of a node
+ * are next to each other, and child points at the left one. The temporary
+ * copy comes from scratch_arena.
+ */
+static void breadth_first(pmr::vector<flat_node>& tree, pmr::memory_resource* scratch_arena)
+{
+    pmr::vector<flat_node> ordered(scratch_arena);
+    pmr::vector<int> source(scratch_arena);
+    ordered.reserve(tree.size());
+    source.reserve(tree.size());
+
+    ordered.push_back(tree[0]);
+    source.push_back(0);
+
+    for(int i = 0; i < (int)ordered.size(); i++)
+    {
+        if(ordered[i].is_leaf())
+        {
+            continue;
+        }
+
+        int right = ordered[i].child;
+        ordered[i].child = ordered.size();
+
+        ordered.push_back(tree[source[i] + 1]);
+        source.push_back(source[i] + 1);
+        ordered.push_back(tree[right]);
+        source.push_back(right);
+    }
+
+    copy(ordered.begin(), ordered.end(), tree.begin());
+}
+
+// How unbalanced a subtree may get before inserts rebuild it: neither child
+// of a node may hold more than this share of its points
+static const double scapegoat_alpha = 2.0 / 3.0;
+
+/**
+ * @fn static int count_points(const shared_blocks<flat_node>& tree, int node)
+ * @brief Counts the points in the subtree rooted at a node.
+ */
+static int count_points(const shared_blocks<flat_node>& tree, int node)
+{
+    const flat_node& temp = tree[node];
+    if(temp.is_leaf())
+    {
+        return temp.leaf_count();
+    }
+    return count_points(tree, temp.child) + count_points(tree, temp.child + 1);
+}
+
+/**
+ * @fn static void take_points(const shared_blocks<flat_node>& tree, const shared_blocks<int>& ids, int node, vector<int>& points, pmr::vector<int>& spare_pairs, pmr::vector<int>* spare_axes)
+ * @brief Collects the points of a subtree that is about to be rebuilt.
+ *
+ * The child slots below the node are handed back to spare_pairs, the node
+ * itself keeps its slot. The axes of the internal nodes go to spare_axes
+ * unless it is NULL, for trees whose axes are ids of their own.
+ */
+static void take_points(const shared_blocks<flat_node>& tree, const shared_blocks<int>& ids, int node, vector<int>& points, pmr::vector<int>& spare_pairs, pmr::vector<int>* spare_axes = NULL)
+{
+    const flat_node& temp = tree[node];
+    if(temp.is_leaf())
+    {
+        for(int i = temp.child; i < temp.child + temp.leaf_count(); i++)
+        {
+            points.push_back(ids[i]);
+        }
+        return;
+    }
+
+    spare_pairs.push_back(temp.child);
+    if(spare_axes != NULL)
+    {
+        spare_axes->push_back(temp.axis);
+    }
+    take_points(tree, ids, temp.child, points, spare_pairs, spare_axes);
+    take_points(tree, ids, temp.child + 1, points, spare_pairs, spare_axes);
+}
+
+/**
+ * @fn static void graft_subtree(shared_blocks<flat_node>& tree, pmr::vector<int>& spare_pairs, int node, const pmr::vector<flat_node>& built, int offset)
+ * @brief Puts a subtree built on its own into the slot of a node.
+ *
+ * The built nodes must be in breadth-first order. Their children take pairs
+ * of slots from spare_pairs, and from the end of the tree once those run out.
+ * The leaf ranges of the built nodes start at offset in the tree's ids.
+ */
+static void graft_subtree(shared_blocks<flat_node>& tree, pmr::vector<int>& spare_pairs, int node, const pmr::vector<flat_node>& built, int offset)
+{
+    vector<int> slot(built.size());
+    slot[0] = node;
+
+    // Parents come before their children, so every slot is known when it is needed
+    for(int i = 0; i < (int)built.size(); i++)
+    {
+        flat_node placed = built[i];
+        if(placed.is_leaf())
+        {
+            placed.child += offset;
+        }
+        else
+        {
+            int children;
+            if(!spare_pairs.empty())
+            {
+                children = spare_pairs.back();
+                spare_pairs.pop_back();
+            }
+            else
+            {
+                children = tree.size();
+                tree.resize(tree.size() + 2);
+            }
+
+            slot[placed.child] = children;
+            slot[placed.child + 1] = children + 1;
+            placed.child = children;
+        }
+        tree.write(slot[i]) = placed;
+    }
+}
+
+/**
+ * @fn static void append_to_leaf(shared_blocks<flat_node>& tree, shared_blocks<int>& ids, int leaf, int id)
+ * @brief Adds a point to a leaf.
+ *
+ * The points of a leaf are contiguous, so unless the leaf already ends ids
+ * they move to the end first. The range they leave is garbage until the
+ * next compaction.
+ */
+static void append_to_leaf(shared_blocks<flat_node>& tree, shared_blocks<int>& ids, int leaf, int id)
+{
+    flat_node temp = tree[leaf];
+    int count = temp.leaf_count();
+
+    if(temp.child + count != (int)ids.size())
+    {
+        int begin = ids.size();
+        ids.resize(begin + count);
+        for(int i = 0; i < count; i++)
+        {
+            ids.write(begin + i) = ids[temp.child + i];
+        }
+        temp.child = begin;
+    }
+
+    ids.push_back(id);
+    temp.axis = -1 - (count + 1);
+    tree.write(leaf) = temp;
+}
+
+/**
+ * @fn static void compact_leaves(shared_blocks<flat_node>& tree, shared_blocks<int>& ids)
+ * @brief Moves the ranges of the leaves together, dropping the garbage between them.
+ *
+ * Ranges only ever move towards the end, so sliding them down in order of
+ * their position never overwrites one that is still to move.
+ */
+static void compact_leaves(shared_blocks<flat_node>& tree, shared_blocks<int>& ids)
+{
+    // The leaves reachable from the root, by the position of their range
+    vector<pair<int, int>> leaves;
+    vector<int> stack(1, 0);
+    while(!stack.empty())
+    {
+        int node = stack.back();
+        stack.pop_back();
+        if(tree[node].is_leaf())
+        {
+            leaves.push_back(make_pair(tree[node].child, node));
+            continue;
+        }
+        stack.push_back(tree[node].child);
+        stack.push_back(tree[node].child + 1);
+    }
+    sort(leaves.begin(), leaves.end());
+
+    int write = 0;
+    for(auto& leaf : leaves)
+    {
+        flat_node temp = tree[leaf.second];
+        for(int i = 0; i < temp.leaf_count(); i++)
+        {
+            ids.write(write + i) = ids[temp.child + i];
+        }
+        temp.child = write;
+        tree.write(leaf.second) = temp;
+        write += temp.leaf_count();
+    }
+    ids.resize(write);
+}
+
+/**
+ * @fn static int find_scapegoat(const shared_blocks<flat_node>& tree, const vector<int>& path, int leaf, int points, int leaf_size)
+ * @brief Picks the subtree to rebuild after an insert left a leaf too deep.
+ *
+ * A tree whose nodes all keep at most alpha of their points in one child is
+ * no deeper than log base 1/alpha of the number of leaves. Once the leaf is
+ * deeper than that, walking up from it reaches an ancestor that breaks the
+ * rule, and rebuilding that ancestor restores the bound. The walk counts
+ * the sibling subtrees it passes, which costs no more than the rebuild.
+ *
+ * @param tree The nodes.
+ * @param path The internal nodes from the root down to the parent of leaf.
+ * @param leaf The leaf the point went into.
+ * @param points The number of points in the tree.
+ * @param leaf_size The most points a leaf may hold.
+ * @return The node to rebuild, -1 if the tree is balanced enough.
+ */
+static int find_scapegoat(const shared_blocks<flat_node>& tree, const vector<int>& path, int leaf, int points, int leaf_size)
+{
+    // Leaves are split in half once they overflow, so they hold at least half of leaf_size points
+    double leaves = max(2.0 * points / max(leaf_size, 1), 1.0);
+    if(path.size() <= log(leaves) / log(1 / scapegoat_alpha) + 1)
+    {
+        return -1;
+    }
+
+    int below = leaf;
+    int size = count_points(tree, leaf);
+    for(int i = path.size() - 1; i >= 0; i--)
+    {
+        const flat_node& parent = tree[path[i]];
+        int sibling = parent.child == below ? parent.child + 1 : parent.child;
+        int total = size + count_points(tree, sibling);
+        if(size > scapegoat_alpha * total)
+        {
+            return path[i];
+        }
+        below = path[i];
+        size = total;
+    }
+    return 0;
+}
+
+// Number of points the spread of a node's dimensions is measured on
+static const int split_sample_size = 128;
+
+/**
+ * @fn int KDTreeIndex::split_dimension(const int* points, int begin, int end)
+ * @brief Picks the dimension in which the points points[begin, end) vary the most.
+ *
+ * The variance is measured on at most split_sample_size evenly spaced
+ * points. Dimensions that are constant over the node, like the blank
+ * border pixels of Fashion-MNIST, are never chosen while another one varies.
+ *
+ * @param points The point indices.
+ * @param begin The first point in points.
+ * @param end One past the last point in points.
+ * @return The dimension.
+ */
+int KDTreeIndex::split_dimension(const int* points, int begin, int end)
+{
+    int n = end - begin;
+    int samples = min(n, split_sample_size);
+
+    int best = 0;
+    double best_variance = -1;
+    for(int j = 0; j < max_cols; j++)
+    {
+        double sum = 0, squares = 0;
+        for(int t = 0; t < samples; t++)
+        {
+            double x = view.row(points[begin + (long long)t * n / samples]).get_element(j);
+            sum += x;
+            squares += x * x;
+        }
+
+        double variance = squares / samples - (sum / samples) * (sum / samples);
+        if(variance > best_variance)
+        {
+            best_variance = variance;
+            best = j;
+        }
+    }
+    return best;
+}
+
+/**
+ * @fn void KDTreeIndex::new_kd_node(pmr::vector<flat_node>& tree, int* points, build_scratch& scratch, int node, int begin, int end)
+ * @brief Builds the subtree over points[begin, end) in depth-first order.
+ *
+ * Up to leaf_size points become a leaf. Larger sets are cut in half at the
+ * median of the dimension with the largest variance, which the node keeps
+ * for the search. The cut is by position rather than by value, so both
+ * children get points even when many of them share the median value.
+ * Nothing is allocated: the node slots are sized in advance and the
+ * subtree works in its own part of scratch. That also lets large subtrees
+ * build their halves as parallel tasks.
+ *
+ * @param tree The nodes being built, left child of a node right after it.
+ * @param points The point indices, grouped by leaf as the build goes.
+ * @param scratch Working space with two entries for every point of the build.
+ * @param node The slot of the subtree root in tree.
+ * @param begin The first point of the subtree in points.
+ * @param end One past the last point of the subtree in points.
+ */
+void KDTreeIndex::new_kd_node(pmr::vector<flat_node>& tree, int* points, build_scratch& scratch, int node, int begin, int end)
+{
+    flat_node& temp = tree[node];
+    int n = end - begin;
+
+    // Small enough sets become a leaf, which is the only place indices are kept
+    if(n <= max(leaf_size, 1))
+    {
+        temp.split = 0;
+        temp.axis = -1 - n;
+        temp.child = begin;
+        return;
+    }
+
+    int dimension = split_dimension(points, begin, end);
+    int chunks = build_chunks(n);
+
+    // Pairing every index with its value in the split dimension
+    pair<double, int>* temp_vector = scratch.values(begin);
+    pair<double, int>* spare = scratch.spare(begin);
+
+    for_chunks(n, chunks, [&](int c, int b, int e)
+    {
+        for(int i = b; i < e; i++)
+        {
+            temp_vector[i] = make_pair(view.row(points[begin + i]).get_element(dimension), points[begin + i]);
+        }
+    });
+
+    // The median lies between the two middle values, the lower half goes left
+    int mid = n / 2;
+    temp.split = split_at_median(temp_vector, n, spare, chunks);
+    temp.axis = dimension;
+
+    // Writing the points back split in two, so each half is a contiguous range
+    for_chunks(n, chunks, [&](int c, int b, int e)
+    {
+        for(int i = b; i < e; i++)
+        {
+            points[begin + i] = temp_vector[i].second;
+        }
+    });
+
+    int left = node + 1;
+    int right = left + subtree_nodes(mid, max(leaf_size, 1));
+    temp.child = right;
+
+    // The halves share nothing, large ones are built side by side
+    if(n > parallel_cutoff)
+    {
+        TaskGroup group;
+        group.run([&]() { new_kd_node(tree, points, scratch, left, begin, begin + mid); });
+        new_kd_node(tree, points, scratch, right, begin + mid, end);
+        group.wait();
+    }
+    else
+    {
+        new_kd_node(tree, points, scratch, left, begin, begin + mid);
+        new_kd_node(tree, points, scratch, right, begin + mid, end);
+    }
+}
+
+/**
+ * @fn void KDTreeIndex::print_kd_tree(int node, int height)
+ * @brief Prints the subtree rooted at a node.
+ * @param node The node, 0 for the whole tree.
+ * @param height The height of the node.
+ */
+void KDTreeIndex::print_kd_tree(int node, int height)
+{
+    if(node >= (int)nodes.size())
+    {
+        return;
+    }
+
+    const flat_node& head = nodes[node];
+    printf("Height: %d\n", height);
+    if(head.is_leaf())
+    {
+        printf("Indices: ");
+        for(int i = head.child; i < head.child + head.leaf_count(); i++)
+        {
+            printf("%d ", ids[i]);
+        }
+        printf("\n\n");
+        return;
+    }
+
+    printf("Dimension: %d\n", head.axis);
+    printf("Median: %.2lf\n\n", head.split);
+
+    print_kd_tree(head.child, height + 1);
+    print_kd_tree(head.child + 1, height + 1);
+}
+
+KDTreeIndex::KDTreeIndex(bool build)
+{
+    if(build)
+    {
+        build_kd_tree();
+    }
+}
+
+/**
+ * @fn void KDTreeIndex::build_kd_tree()
+ * @brief Builds the tree over the rows of view that are not deleted.
+ *
+ * Only view is read, so the build needs no lock on the training set.
+ */
+void KDTreeIndex::build_kd_tree()
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    // The selection buffer, the reordering copy and the tree itself live until the end of the build
+    pmr::monotonic_buffer_resource scratch_arena;
+
+    // Sending the all the indices in the DataSet that are not deleted to the root
+    int n = view.rows;
+    pmr::vector<int> points(&scratch_arena);
+    points.reserve(n);
+    for(int i = 0; i < n; i++)
+    {
+        if(!view.is_deleted(i))
+        {
+            points.push_back(i);
+        }
+    }
+    int live = points.size();
+
+    build_scratch scratch(0, live, &scratch_arena);
+    pmr::vector<flat_node> built(subtree_nodes(live, max(leaf_size, 1)), &scratch_arena);
+    new_kd_node(built, points.data(), scratch, 0, 0, live);
+    breadth_first(built, &scratch_arena);
+    nodes.assign(built.data(), built.size());
+    ids.assign(points.data(), live);
+    indexed = n;
+    printf("\nKD-Tree successfully built\n");
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    printf("Time taken to build KD-Tree: %ld ms\n\n", duration.count());
+}
+
+KDTreeIndex::KDTreeIndex(const KDTreeIndex& other) : TreeIndex(other), nodes(other.nodes), ids(other.ids),
+    spare_pairs(other.spare_pairs, &arena), indexed(other.indexed)
+{
+}
+
+/**
+ * @fn bool KDTreeIndex::save(const char* path)
+ * @brief Writes the tree in the saved index format.
+ * @param path The index file.
+ * @return False if the file could not be written.
+ */
+bool KDTreeIndex::save(const char* path)
+{
+    index_header header = new_index_header(view, index_kind_kd, leaf_size, 1, false, indexed, deleted_at_build);
+
+    index_tree_header tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.nodes = nodes.size();
+    tree.ids = ids.size();
+    tree.spare_pairs = spare_pairs.size();
+
+    return write_index(path, header, [&](FILE* file, uint32_t& crc)
+    {
+        return write_section(file, &tree, sizeof(tree), crc) && write_array(file, nodes, crc)
+            && write_array(file, ids, crc) && write_array(file, spare_pairs, crc);
+    });
+}
+
+/**
+ * @fn KDTreeIndex* KDTreeIndex::load(const char* path)
+ * @brief Reads a tree saved by save without building anything.
+ *
+ * Rows added to the training set since the tree was saved are then
+ * inserted into it.
+ *
+ * @param path The index file.
+ * @return The tree, or NULL if the file is missing, damaged, or was
+ * saved for another dataset or with another leaf_size.
+ */
+KDTreeIndex* KDTreeIndex::load(const char* path)
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    KDTreeIndex* index = new KDTreeIndex(false);
+    index_header header;
+    size_t remaining;
+    FILE* file = open_index(path, index->D, index_kind_kd, leaf_size, 1, false, header, remaining);
+    if(file == NULL)
+    {
+        delete index;
+        return NULL;
+    }
+
+    index_tree_header tree;
+    uint32_t crc = 0;
+    bool ok = read_section(file, &tree, sizeof(tree), remaining, crc) && tree.nodes > 0
+        && read_array(file, index->nodes, tree.nodes, remaining, crc)
+        && read_array(file, index->ids, tree.ids, remaining, crc)
+        && read_array(file, index->spare_pairs, tree.spare_pairs, remaining, crc)
+        && remaining == 0 && crc == header.checksum
+        && valid_tree(index->nodes, index->ids, index->spare_pairs, header.cols, header.indexed);
+    fclose(file);
+    if(!ok)
+    {
+        printf("%s is damaged\n", path);
+        delete index;
+        return NULL;
+    }
+
+    index->indexed = header.indexed;
+    index->deleted_at_build = header.deleted;
+    printf("\nKD-Tree successfully loaded from %s\n", path);
+    if(index->indexed < index->D.row_size())
+    {
+        index->catch_up();
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    printf("Time taken to load KD-Tree: %ld ms\n\n", duration.count());
+    return index;
+}
+
+/**
+ * @fn shared_ptr<KDTreeIndex> KDTreeIndex::load_or_build()
+ * @brief Loads the tree from index_path, or builds it and saves it
+ * there, and publishes it unless another thread got there first.
+ * @return The current version.
+ */
+shared_ptr<KDTreeIndex> KDTreeIndex::load_or_build()
+{
+    shared_lock<shared_mutex> layout(layout_lock);
+    lock_guard<mutex> guard(publishing);
+
+    shared_ptr<KDTreeIndex> version = atomic_load(&current);
+    if(version != NULL)
+    {
+        return version;
+    }
+
+    version.reset(index_path != NULL ? load(index_path) : NULL);
+    if(version == NULL)
+    {
+        version.reset(new KDTreeIndex());
+        if(index_path != NULL && !version->save(index_path))
+        {
+            printf("Cannot save the KD-Tree to %s\n", index_path);
+        }
+    }
+    publish(version);
+    return version;
+}
+
+/**
+ * @fn void KDTreeIndex::publish(shared_ptr<KDTreeIndex> version)
+ * @brief Makes a version the one new searches get.
+ *
+ * Searches still holding the previous version finish on it, and it is
+ * freed when the last of them lets go.
+ *
+ * @param version The version, which must not change any more.
+ */
+void KDTreeIndex::publish(shared_ptr<KDTreeIndex> version)
+{
+    version->view = version->D.snapshot();
+    atomic_store(&current, version);
+}
+
+shared_mutex TreeIndex::layout_lock;
+shared_ptr<KDTreeIndex> KDTreeIndex::current;
+shared_ptr<RPTreeIndex> RPTreeIndex::current;
+mutex KDTreeIndex::publishing;
+mutex RPTreeIndex::publishing;
+future<void> KDTreeIndex::rebuilding;
+future<void> RPTreeIndex::rebuilding;
+
+/**
+ * @fn void KDTreeIndex::rebuild_kd_subtree(int node)
+ * @brief Rebuilds the subtree rooted at a node from its points.
+ *
+ * The points are built over on the side and written back, a leaf's where
+ * they already are and any other subtree's at the end of ids, so only the
+ * blocks holding them are copied. The new nodes are grafted into the slots
+ * the old ones freed.
+ *
+ * @param node The root of the subtree, which keeps its slot.
+ */
+void KDTreeIndex::rebuild_kd_subtree(int node)
+{
+    vector<int> points;
+    take_points(nodes, ids, node, points, spare_pairs);
+    int begin = nodes[node].is_leaf() ? nodes[node].child : (int)ids.size();
+    int count = points.size();
+
+    pmr::monotonic_buffer_resource scratch_arena;
+    build_scratch scratch(0, count, &scratch_arena);
+    pmr::vector<flat_node> built(subtree_nodes(count, max(leaf_size, 1)), &scratch_arena);
+    new_kd_node(built, points.data(), scratch, 0, 0, count);
+    breadth_first(built, &scratch_arena);
+
+    ids.resize(max(ids.size(), (size_t)(begin + count)));
+    for(int i = 0; i < count; i++)
+    {
+        ids.write(begin + i) = points[i];
+    }
+    graft_subtree(nodes, spare_pairs, node, built, begin);
+}
+
+/**
+ * @fn void KDTreeIndex::catch_up()
+ * @brief Inserts the rows added to the training set since the tree last saw it.
+ *
+ * Every row goes down to its leaf, which is split once it holds more than
+ * leaf_size points. If the leaf ends up deeper than a balanced tree allows,
+ * the unbalanced subtree above it is rebuilt, so a stream of inserts keeps
+ * the searches logarithmic without ever rebuilding the whole tree.
+ */
+void KDTreeIndex::catch_up()
+{
+    // The caller holds layout_lock, so the rows added since can be taken in
+    view = D.snapshot();
+    for(; indexed < view.rows; indexed++)
+    {
+        vector<int> path;
+        int node = 0;
+        while(!nodes[node].is_leaf())
+        {
+            const flat_node& temp = nodes[node];
+            path.push_back(node);
+            node = temp.child + (view.row(indexed).get_element(temp.axis) > temp.split);
+        }
+
+        append_to_leaf(nodes, ids, node, indexed);
+        if(nodes[node].leaf_count() > max(leaf_size, 1))
+        {
+            rebuild_kd_subtree(node);
+            path.push_back(node);
+            node = nodes[node].child;
+        }
+
+        int scapegoat = find_scapegoat(nodes, path, node, indexed + 1, leaf_size);
+        if(scapegoat >= 0)
+        {
+            rebuild_kd_subtree(scapegoat);
+        }
+
+        // The ranges leaves moved away from are reclaimed once they outnumber the points
+        if(ids.size() > 2 * (size_t)(indexed + 1) + max(leaf_size, 1))
+        {
+            compact_leaves(nodes, ids);
+        }
+    }
+    printf("KD-Tree successfully updated on addition\n");
+}
+
+/**
+ * @fn void KDTreeIndex::add_kd_vector(int d)
+ * @brief Publishes a version of the KD-Tree with a vector added to the shared training set.
+ *
+ * The current version is copied and the copy takes the new rows in, so
+ * searches running meanwhile are not disturbed. Rows added while the tree
+ * did not exist are already in it.
+ *
+ * @param d The index of the new vector. A tree that already took it in,
+ * while catching up with an earlier add or a compaction, is left as it is.
+ */
+void KDTreeIndex::add_kd_vector(int d)
+{
+    shared_lock<shared_mutex> layout(layout_lock);
+    lock_guard<mutex> guard(publishing);
+
+    shared_ptr<KDTreeIndex> version = atomic_load(&current);
+    if(version == NULL || d < version->indexed)
+    {
+        return;
+    }
+
+    shared_ptr<KDTreeIndex> next(new KDTreeIndex(*version));
+    next->catch_up();
+    publish(next);
+}
+
+/**
+ * @fn void KDTreeIndex::delete_kd_vector(int d)
+ * @brief Updates the KD-Tree after a vector was deleted from the shared training set.
+ *
+ * The point stays in its leaf and searches skip it. Once enough of the
+ * tree is deleted, a tree without them is built on a thread of its own
+ * from a snapshot of the training set, so rows can still be added. Those
+ * are inserted into it before it is published.
+ *
+ * @param d The index of the vector.
+ */
+void KDTreeIndex::delete_kd_vector(int d)
+{
+    lock_guard<mutex> guard(publishing);
+    shared_ptr<KDTreeIndex> version = atomic_load(&current);
+    bool idle = !rebuilding.valid() || rebuilding.wait_for(chrono::seconds(0)) == future_status::ready;
+
+    // A row the tree never had does not count towards its deleted points
+    if(version != NULL && d < version->indexed && idle && version->needs_compaction(version->indexed))
+    {
+        rebuilding = async(launch::async, []()
+        {
+            // Only the snapshot is taken under the lock, the build reads nothing else
+            shared_ptr<KDTreeIndex> rebuilt;
+            {
+                shared_lock<shared_mutex> layout(layout_lock);
+                rebuilt.reset(new KDTreeIndex(false));
+            }
+            rebuilt->build_kd_tree();
+
+            // Rows added during the build go in before it replaces the current version
+            {
+                shared_lock<shared_mutex> layout(layout_lock);
+                lock_guard<mutex> guard(publishing);
+                if(rebuilt->indexed < rebuilt->D.row_size())
+                {
+                    rebuilt->catch_up();
+                }
+                publish(rebuilt);
+            }
+            if(index_path != NULL && !rebuilt->save(index_path))
+            {
+                printf("Cannot save the KD-Tree to %s\n", index_path);
+            }
+        });
+        printf("KD-Tree compaction started in the background\n");
+    }
+    printf("KD-Tree successfully updated after deletion\n");
+}
+
+/**
+ * @fn void KDTreeIndex::finish_compaction()
+ * @brief Waits until a background compaction is published and saved.
+ *
+ * The compaction uses the training set and the statics of the class, so
+ * it must end before main returns and they are destroyed.
+ */
+void KDTreeIndex::finish_compaction()
+{
+    // The compaction takes publishing to publish, so it is not held while waiting
+    future<void> pending;
+    {
+        lock_guard<mutex> guard(publishing);
+        pending = move(rebuilding);
+    }
+    if(pending.valid())
+    {
+        printf("Waiting for the KD-Tree compaction to finish\n");
+        pending.wait();
+    }
+}
+
+/**
+ * @fn void RPTreeIndex::print_rp_tree(int node, int height, int tree)
+ * @brief Prints the subtree rooted at a node.
+ * @param node The node, 0 for the whole tree.
+ * @param height The height of the node.
+ * @param tree The tree of the forest the node is in.
+ */
+void RPTreeIndex::print_rp_tree(int node, int height, int tree)
+{
+    if(tree >= (int)forest.size() || node >= (int)forest[tree].nodes.size())
+    {
+        return;
+    }
+
+    const rp_tree& current = forest[tree];
+    const flat_node& head = current.nodes[node];
+    printf("Height: %d\n", height);
+    if(head.is_leaf())
+    {
+        printf("Indices: ");
+        for(int i = head.child; i < head.child + head.leaf_count(); i++)
+        {
+            printf("%d ", current.ids[i]);
+        }
+        printf("\n\n");
+        return;
+    }
+
+    printf("Median: %.2lf\n", head.split);
+    if(current.sparse)
+    {
+        printf("Sparse direction %d of seed %u\n\n", head.axis, current.seed);
+    }
+    else
+    {
+        printf("Median Vector: ");
+        for(int j = 0; j < max_cols; j++)
+        {
+            printf("%.2lf ", (double)current.projections.row(head.axis)[j]);
+        }
+        printf("\n\n");
+    }
+
+    print_rp_tree(head.child, height + 1, tree);
+    print_rp_tree(head.child + 1, height + 1, tree);
+}
+
+/**
+ * @fn static void random_direction(scalar_t* v, int dimension, mt19937& generator)
+ * @brief Fills v with a random direction of unit length.
+ *
+ * The entries are independent standard normals, so every direction is
+ * equally likely.
+ */
+static void random_direction(scalar_t* v, int dimension, mt19937& generator)
+{
+    normal_distribution<double> random(0.0, 1.0);
+
+    double magnitude = 0;
+    for(int i = 0; i < dimension; i++)
+    {
+        double temp = random(generator);
+        v[i] = temp;
+        magnitude += temp*temp;
+    }
+    magnitude = sqrt(magnitude);
+
+    for(int i=0; i < dimension; i++)
+    {
+        v[i] = v[i] / magnitude;
+    }
+}
+
+/**
+ * @fn static inline uint64_t mix64(uint64_t x)
+ * @brief Scrambles x into 64 well distributed bits, the splitmix64 finaliser.
+ */
+static inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @fn static int sparse_runs(int dimension)
+ * @brief Gives the number of runs, and so of taps, of a sparse direction.
+ */
+static int sparse_runs(int dimension)
+{
+    int run = max((int)sqrt((double)dimension), 1);
+    return (dimension + run - 1) / run;
+}
+
+/**
+ * @fn static void sparse_direction(int* taps, int dimension, unsigned seed, int proj)
+ * @brief Draws a very sparse random direction of unit length.
+ *
+ * The dimensions are cut into runs of sqrt(d). Each run holds a single
+ * nonzero entry, +1 or -1, at a place hashed from the seed, the projection
+ * id and the run, so the direction can be drawn again instead of being
+ * saved. Projections are scaled by one over the root of the runs.
+ *
+ * @param taps Gets one entry per run, j for +1 at column j and ~j for -1 there.
+ * @param dimension The number of columns.
+ * @param seed The seed of the tree.
+ * @param proj The projection id.
+ */
+static void sparse_direction(int* taps, int dimension, unsigned seed, int proj)
+{
+    int run = max((int)sqrt((double)dimension), 1);
+    uint64_t key = mix64(((uint64_t)seed << 32) | (unsigned)proj);
+    int count = 0;
+    for(int begin = 0; begin < dimension; begin += run, count++)
+    {
+        uint64_t bits = mix64(key + count);
+        int j = begin + (int)(((bits >> 32) * (uint64_t)min(run, dimension - begin)) >> 32);
+        taps[count] = (bits & 1) ? ~j : j;
+    }
+}
+
+/**
+ * @fn static inline double sparse_project(const int* taps, int count, const scalar_t* x)
+ * @brief Projects x onto a sparse direction.
+ * @param taps The taps of the direction.
+ * @param count The number of taps.
+ * @param x The vector.
+ * @return The projection of x.
+ */
+static inline double sparse_project(const int* taps, int count, const scalar_t* x)
+{
+    double sum = 0;
+    for(int t = 0; t < count; t++)
+    {
+        sum += taps[t] >= 0 ? (double)x[taps[t]] : -(double)x[~taps[t]];
+    }
+    return count > 0 ? sum / sqrt((double)count) : 0.0;
+}
+
+/**
+ * @fn static inline double rp_project(const rp_tree& tree, int proj, const scalar_t* x, int width, const distance_kernels& kernels)
+ * @brief Projects x onto a direction of a tree.
+ * @param tree The tree.
+ * @param proj The projection id.
+ * @param x The vector, padded to width.
+ * @param width The stride of the dataset.
+ * @param kernels The distance kernels in use.
+ * @return The projection of x.
+ */
+static inline double rp_project(const rp_tree& tree, int proj, const scalar_t* x, int width, const distance_kernels& kernels)
+{
+    if(tree.sparse)
+    {
+        return sparse_project(tree.taps.row(proj), tree.taps.row_width(), x);
+    }
+    return kernels.dot(tree.projections.row(proj), x, width);
+}
+
+/**
+ * @fn void RPTreeIndex::new_rp_node(rp_tree& tree, pmr::vector<flat_node>& nodes, int* points, build_scratch& scratch, int node, int begin, int end, int proj, const int* proj_ids)
+ * @brief Builds the subtree over points[begin, end) in depth-first order.
+ *
+ * Up to leaf_size points become a leaf. Larger sets are projected onto a
+ * new random direction and cut in half at the median projection. Like the
+ * KD-Tree builder it allocates nothing and builds large halves in parallel.
+ *
+ * @param tree The tree the directions belong to.
+ * @param nodes The nodes being built, left child of a node right after it.
+ * @param points The point indices, grouped by leaf as the build goes.
+ * @param scratch Working space with two entries for every point of the build.
+ * @param node The slot of the subtree root in nodes.
+ * @param begin The first point of the subtree in points.
+ * @param end One past the last point of the subtree in points.
+ * @param proj The first projection id the subtree may use.
+ * @param proj_ids The projection ids to use in place of proj, proj + 1
+ * and so on, or NULL to use those.
+ */
+void RPTreeIndex::new_rp_node(rp_tree& tree, pmr::vector<flat_node>& nodes, int* points, build_scratch& scratch, int node, int begin, int end, int proj, const int* proj_ids)
+{
+    flat_node& temp = nodes[node];
+    int n = end - begin;
+
+    // Small enough sets become a leaf, which is the only place indices are kept
+    if(n <= max(leaf_size, 1))
+    {
+        temp.split = 0;
+        temp.axis = -1 - n;
+        temp.child = begin;
+        return;
+    }
+
+    // Allocating the random vector, drawn from a generator of its own
+    int width = view.stride;
+    int id = proj_ids != NULL ? proj_ids[proj] : proj;
+    if(tree.sparse)
+    {
+        sparse_direction(tree.taps.write_row(id), max_cols, tree.seed, id);
+    }
+    else
+    {
+        seed_seq sequence{tree.seed, (unsigned)id};
+        mt19937 generator(sequence);
+        random_direction(tree.projections.write_row(id), max_cols, generator);
+    }
+    temp.axis = id;
+
+    int chunks = build_chunks(n);
+    const distance_kernels& kernels = distance_kernels::best();
+
+    // Pairing every index with its projection
+    pair<double, int>* temp_vector = scratch.values(begin);
+    pair<double, int>* spare = scratch.spare(begin);
+
+    for_chunks(n, chunks, [&](int c, int b, int e)
+    {
+        for(int i = b; i < e; i++)
+        {
+            const scalar_t* row = view.row(points[begin + i]).data();
+            temp_vector[i] = make_pair(rp_project(tree, id, row, width, kernels), points[begin + i]);
+        }
+    });
+
+    // Finding the median, the lower half goes left
+    int mid = n / 2;
+    temp.split = split_at_median(temp_vector, n, spare, chunks);
+
+    for_chunks(n, chunks, [&](int c, int b, int e)
+    {
+        for(int i = b; i < e; i++)
+        {
+            points[begin + i] = temp_vector[i].second;
+        }
+    });
+
+    // A full binary tree of m nodes has (m - 1) / 2 internal ones
+    int left_nodes = subtree_nodes(mid, max(leaf_size, 1));
+    int left = node + 1;
+    int right = left + left_nodes;
+    temp.child = right;
+
+    // The halves share nothing, large ones are built side by side
+    if(n > parallel_cutoff)
+    {
+        TaskGroup group;
+        group.run([&]() { new_rp_node(tree, nodes, points, scratch, left, begin, begin + mid, proj + 1, proj_ids); });
+        new_rp_node(tree, nodes, points, scratch, right, begin + mid, end, proj + 1 + (left_nodes - 1) / 2, proj_ids);
+        group.wait();
+    }
+    else
+    {
+        new_rp_node(tree, nodes, points, scratch, left, begin, begin + mid, proj + 1, proj_ids);
+        new_rp_node(tree, nodes, points, scratch, right, begin + mid, end, proj + 1 + (left_nodes - 1) / 2, proj_ids);
+    }
+}
+
+/**
+ * @fn void RPTreeIndex::build_rp_tree(rp_tree& tree, const vector<int>& live)
+ * @brief Builds a tree whose directions are already sized.
+ * @param tree The tree, with a seed.
+ * @param live The points of the tree.
+ */
+void RPTreeIndex::build_rp_tree(rp_tree& tree, const vector<int>& live)
+{
+    // The selection buffer, the reordering copy and the tree itself live until the end of the build
+    pmr::monotonic_buffer_resource scratch_arena;
+    pmr::vector<int> points(live.begin(), live.end(), &scratch_arena);
+    build_scratch scratch(0, points.size(), &scratch_arena);
+    pmr::vector<flat_node> built(subtree_nodes(points.size(), max(leaf_size, 1)), &scratch_arena);
+
+    new_rp_node(tree, built, points.data(), scratch, 0, 0, (int)points.size(), 0);
+    breadth_first(built, &scratch_arena);
+    tree.nodes.assign(built.data(), built.size());
+    tree.ids.assign(points.data(), points.size());
+}
+
+RPTreeIndex::RPTreeIndex(bool build)
+{
+    if(build)
+    {
+        build_forest();
+    }
+}
+
+/**
+ * @fn void RPTreeIndex::build_forest()
+ * @brief Builds the trees over the rows of view that are not deleted.
+ *
+ * Only view is read, so the build needs no lock on the training set.
+ */
+void RPTreeIndex::build_forest()
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    // Sending the all the indices in the DataSet that are not deleted to the root
+    int n = view.rows;
+    vector<int> live;
+    live.reserve(n);
+    for(int i = 0; i < n; i++)
+    {
+        if(!view.is_deleted(i))
+        {
+            live.push_back(i);
+        }
+    }
+
+    // The arena is not thread-safe, so every tree is sized before any is built
+    int count = max(trees, 1);
+    forest.reserve(count);
+    for(int t = 0; t < count; t++)
+    {
+        forest.emplace_back(&arena, view.stride, sparse_runs(max_cols));
+        rp_tree& tree = forest.back();
+
+        // A fixed seed gives every tree a seed of its own, the same on every build
+        tree.seed = seed != 0 ? (unsigned)mix64(((uint64_t)seed << 32) | (unsigned)t) : rand();
+        tree.sparse = sparse_projections;
+        tree.directions = (subtree_nodes(live.size(), max(leaf_size, 1)) - 1) / 2;
+        if(tree.sparse)
+        {
+            tree.taps.resize(tree.directions);
+        }
+        else
+        {
+            tree.projections.resize(tree.directions);
+        }
+    }
+
+    // The trees only share the dataset, so they are built side by side
+    TaskGroup group;
+    for(int t = 1; t < count; t++)
+    {
+        group.run([this, t, &live]() { build_rp_tree(forest[t], live); });
+    }
+    build_rp_tree(forest[0], live);
+    group.wait();
+    indexed = n;
+
+    if(count == 1)
+    {
+        printf("RP-Tree successfully built\n");
+    }
+    else
+    {
+        printf("RP-Forest of %d trees successfully built\n", count);
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    printf("Time taken to build RP-Tree: %ld ms\n\n", duration.count());
+}
+
+RPTreeIndex::RPTreeIndex(const RPTreeIndex& other) : TreeIndex(other), indexed(other.indexed)
+{
+    forest.reserve(other.forest.size());
+    for(const rp_tree& tree : other.forest)
+    {
+        forest.emplace_back(tree, &arena);
+    }
+}
+
+/**
+ * @fn bool RPTreeIndex::save(const char* path)
+ * @brief Writes the forest in the saved index format.
+ * @param path The index file.
+ * @return False if the file could not be written.
+ */
+bool RPTreeIndex::save(const char* path)
+{
+    index_header header = new_index_header(view, index_kind_rp, leaf_size, forest.size(), forest[0].sparse, indexed, deleted_at_build);
+
+    return write_index(path, header, [&](FILE* file, uint32_t& crc)
+    {
+        for(const rp_tree& tree : forest)
+        {
+            index_tree_header head;
+            memset(&head, 0, sizeof(head));
+            head.nodes = tree.nodes.size();
+            head.ids = tree.ids.size();
+            head.spare_pairs = tree.spare_pairs.size();
+            head.directions = tree.directions;
+            head.seed = tree.seed;
+            head.spare_directions = tree.spare_directions.size();
+            head.projections = tree.projections.size() * (uint64_t)tree.projections.row_width();
+
+            if(!write_section(file, &head, sizeof(head), crc) || !write_array(file, tree.nodes, crc) || !write_array(file, tree.ids, crc)
+                || !write_array(file, tree.spare_pairs, crc) || !write_array(file, tree.spare_directions, crc)
+                || !write_array(file, tree.projections, crc))
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+/**
+ * @fn RPTreeIndex* RPTreeIndex::load(const char* path)
+ * @brief Reads a forest saved by save without building anything.
+ *
+ * Sparse directions are drawn again from the saved seeds, Gaussian ones
+ * are read back. Rows added to the training set since the forest was
+ * saved are then inserted into it.
+ *
+ * @param path The index file.
+ * @return The forest, or NULL if the file is missing, damaged, or was
+ * saved for another dataset or with other trees, leaf_size or
+ * sparse_projections.
+ */
+RPTreeIndex* RPTreeIndex::load(const char* path)
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    RPTreeIndex* index = new RPTreeIndex(false);
+    index_header header;
+    size_t remaining;
+    FILE* file = open_index(path, index->D, index_kind_rp, leaf_size, max(trees, 1), sparse_projections, header, remaining);
+    if(file == NULL)
+    {
+        delete index;
+        return NULL;
+    }
+
+    uint32_t crc = 0;
+    bool ok = true;
+    index->forest.reserve(header.trees);
+    for(uint32_t t = 0; t < header.trees && ok; t++)
+    {
+        index->forest.emplace_back(&index->arena, index->D.row_stride(), sparse_runs(max_cols));
+        rp_tree& tree = index->forest.back();
+
+        // Every projection id of a Gaussian tree must have its direction
+        index_tree_header head;
+        ok = read_section(file, &head, sizeof(head), remaining, crc) && head.nodes > 0
+            && head.projections == (header.sparse ? 0 : (uint64_t)head.directions * index->D.row_stride())
+            && read_array(file, tree.nodes, head.nodes, remaining, crc)
+            && read_array(file, tree.ids, head.ids, remaining, crc)
+            && read_array(file, tree.spare_pairs, head.spare_pairs, remaining, crc)
+            && read_array(file, tree.spare_directions, head.spare_directions, remaining, crc)
+            && read_array(file, tree.projections, head.projections / index->D.row_stride(), remaining, crc);
+        tree.seed = head.seed;
+        tree.sparse = header.sparse;
+        tree.directions = head.directions;
+
+        ok = ok && (int)head.directions >= 0 && valid_tree(tree.nodes, tree.ids, tree.spare_pairs, head.directions, header.indexed);
+        for(int i = 0; ok && i < (int)tree.spare_directions.size(); i++)
+        {
+            ok = tree.spare_directions[i] >= 0 && tree.spare_directions[i] < tree.directions;
+        }
+
+        // Sparse taps are not saved, they are hashed again
+        if(ok && tree.sparse)
+        {
+            tree.taps.resize(tree.directions);
+            for(int id = 0; id < tree.directions; id++)
+            {
+                sparse_direction(tree.taps.write_row(id), max_cols, tree.seed, id);
+            }
+        }
+    }
+    ok = ok && remaining == 0 && crc == header.checksum;
+    fclose(file);
+    if(!ok)
+    {
+        printf("%s is damaged\n", path);
+        delete index;
+        return NULL;
+    }
+
+    index->indexed = header.indexed;
+    index->deleted_at_build = header.deleted;
+    printf("RP-Tree successfully loaded from %s\n", path);
+    if(index->indexed < index->D.row_size())
+    {
+        index->catch_up();
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    printf("Time taken to load RP-Tree: %ld ms\n\n", duration.count());
+    return index;
+}
+
+/**
+ * @fn shared_ptr<RPTreeIndex> RPTreeIndex::load_or_build()
+ * @brief Loads the forest from index_path, or builds it and saves it
+ * there, and publishes it unless another thread got there first.
+ * @return The current version.
+ */
+shared_ptr<RPTreeIndex> RPTreeIndex::load_or_build()
+{
+    shared_lock<shared_mutex> layout(layout_lock);
+    lock_guard<mutex> guard(publishing);
+
+    shared_ptr<RPTreeIndex> version = atomic_load(&current);
+    if(version != NULL)
+    {
+        return version;
+    }
+
+    version.reset(index_path != NULL ? load(index_path) : NULL);
+    if(version == NULL)
+    {
+        version.reset(new RPTreeIndex());
+        if(index_path != NULL && !version->save(index_path))
+        {
+            printf("Cannot save the RP-Tree to %s\n", index_path);
+        }
+    }
+    publish(version);
+    return version;
+}
+
+/**
+ * @fn void RPTreeIndex::publish(shared_ptr<RPTreeIndex> version)
+ * @brief Makes a version the one new searches get.
+ * @param version The version, which must not change any more.
+ */
+void RPTreeIndex::publish(shared_ptr<RPTreeIndex> version)
+{
+    version->view = version->D.snapshot();
+    atomic_store(&current, version);
+}
+
+/**
+ * @fn void RPTreeIndex::rebuild_rp_subtree(rp_tree& tree, int node)
+ * @brief Rebuilds the subtree rooted at a node of a tree from its points.
+ *
+ * Works like the KD-Tree version. The new splits take the projection ids
+ * the old ones freed before drawing fresh ones, so a tree keeps about one
+ * stored direction per internal node however often it is rebuilt.
+ *
+ * @param tree The tree.
+ * @param node The root of the subtree, which keeps its slot.
+ */
+void RPTreeIndex::rebuild_rp_subtree(rp_tree& tree, int node)
+{
+    vector<int> points;
+    take_points(tree.nodes, tree.ids, node, points, tree.spare_pairs, &tree.spare_directions);
+    int begin = tree.nodes[node].is_leaf() ? tree.nodes[node].child : (int)tree.ids.size();
+    int count = points.size();
+
+    pmr::monotonic_buffer_resource scratch_arena;
+    build_scratch scratch(0, count, &scratch_arena);
+    pmr::vector<flat_node> built(subtree_nodes(count, max(leaf_size, 1)), &scratch_arena);
+
+    vector<int> proj_ids((built.size() - 1) / 2);
+    for(int& id : proj_ids)
+    {
+        if(!tree.spare_directions.empty())
+        {
+            id = tree.spare_directions.back();
+            tree.spare_directions.pop_back();
+        }
+        else
+        {
+            id = tree.directions++;
+        }
+    }
+    // Blocks of directions shared with other versions are copied here, before the halves are built side by side
+    if(tree.sparse)
+    {
+        tree.taps.resize(tree.directions);
+        for(int id : proj_ids)
+        {
+            tree.taps.write_row(id);
+        }
+    }
+    else
+    {
+        tree.projections.resize(tree.directions);
+        for(int id : proj_ids)
+        {
+            tree.projections.write_row(id);
+        }
+    }
+
+    new_rp_node(tree, built, points.data(), scratch, 0, 0, count, 0, proj_ids.data());
+    breadth_first(built, &scratch_arena);
+
+    tree.ids.resize(max(tree.ids.size(), (size_t)(begin + count)));
+    for(int i = 0; i < count; i++)
+    {
+        tree.ids.write(begin + i) = points[i];
+    }
+    graft_subtree(tree.nodes, tree.spare_pairs, node, built, begin);
+}
+
+/**
+ * @fn void RPTreeIndex::insert_rp_point(rp_tree& tree, int id)
+ * @brief Inserts a point of the training set into one tree.
+ * @param tree The tree.
+ * @param id The index of the point.
+ */
+void RPTreeIndex::insert_rp_point(rp_tree& tree, int id)
+{
+    const distance_kernels& kernels = distance_kernels::best();
+    int width = view.stride;
+    const scalar_t* row = view.row(id).data();
+
+    vector<int> path;
+    int node = 0;
+    while(!tree.nodes[node].is_leaf())
+    {
+        const flat_node& temp = tree.nodes[node];
+        path.push_back(node);
+        node = temp.child + (rp_project(tree, temp.axis, row, width, kernels) > temp.split);
+    }
+
+    append_to_leaf(tree.nodes, tree.ids, node, id);
+    if(tree.nodes[node].leaf_count() > max(leaf_size, 1))
+    {
+        rebuild_rp_subtree(tree, node);
+        path.push_back(node);
+        node = tree.nodes[node].child;
+    }
+
+    int scapegoat = find_scapegoat(tree.nodes, path, node, id + 1, leaf_size);
+    if(scapegoat >= 0)
+    {
+        rebuild_rp_subtree(tree, scapegoat);
+    }
+
+    // The ranges leaves moved away from are reclaimed once they outnumber the points
+    if(tree.ids.size() > 2 * (size_t)(id + 1) + max(leaf_size, 1))
+    {
+        compact_leaves(tree.nodes, tree.ids);
+    }
+}
+
+/**
+ * @fn void RPTreeIndex::catch_up()
+ * @brief Inserts the rows added to the training set since the forest last saw them.
+ *
+ * The same way as the KD-Tree: down to a leaf, which splits once it is
+ * full, with scapegoat rebuilds keeping the trees balanced.
+ */
+void RPTreeIndex::catch_up()
+{
+    // The caller holds layout_lock, so the rows added since can be taken in
+    view = D.snapshot();
+    for(; indexed < view.rows; indexed++)
+    {
+        for(rp_tree& tree : forest)
+        {
+            insert_rp_point(tree, indexed);
+        }
+    }
+    printf("RP-Tree successfully updated on addition\n");
+}
+
+/**
+ * @fn void RPTreeIndex::add_rp_vector(int d)
+ * @brief Publishes a version of the forest with a vector added to the shared training set.
+ *
+ * Works like the KD-Tree version, every tree of the copy takes the row in.
+ *
+ * @param d The index of the new vector. A forest that already took it in,
+ * while catching up with an earlier add or a compaction, is left as it is.
+ */
+void RPTreeIndex::add_rp_vector(int d)
+{
+    shared_lock<shared_mutex> layout(layout_lock);
+    lock_guard<mutex> guard(publishing);
+
+    shared_ptr<RPTreeIndex> version = atomic_load(&current);
+    if(version == NULL || d < version->indexed)
+    {
+        return;
+    }
+
+    shared_ptr<RPTreeIndex> next(new RPTreeIndex(*version));
+    next->catch_up();
+    publish(next);
+}
+
+/**
+ * @fn void RPTreeIndex::delete_rp_vector(int d)
+ * @brief Updates the RP-Tree after a vector was deleted from the shared training set.
+ *
+ * Works like the KD-Tree version, the whole forest is rebuilt together.
+ *
+ * @param d The index of the vector.
+ */
+void RPTreeIndex::delete_rp_vector(int d)
+{
+    lock_guard<mutex> guard(publishing);
+    shared_ptr<RPTreeIndex> version = atomic_load(&current);
+    bool idle = !rebuilding.valid() || rebuilding.wait_for(chrono::seconds(0)) == future_status::ready;
+
+    // A row the forest never had does not count towards its deleted points
+    if(version != NULL && d < version->indexed && idle && version->needs_compaction(version->indexed))
+    {
+        rebuilding = async(launch::async, []()
+        {
+            // Only the snapshot is taken under the lock, the build reads nothing else
+            shared_ptr<RPTreeIndex> rebuilt;
+            {
+                shared_lock<shared_mutex> layout(layout_lock);
+                rebuilt.reset(new RPTreeIndex(false));
+            }
+            rebuilt->build_forest();
+
+            // Rows added during the build go in before it replaces the current version
+            {
+                shared_lock<shared_mutex> layout(layout_lock);
+                lock_guard<mutex> guard(publishing);
+                if(rebuilt->indexed < rebuilt->D.row_size())
+                {
+                    rebuilt->catch_up();
+                }
+                publish(rebuilt);
+            }
+            if(index_path != NULL && !rebuilt->save(index_path))
+            {
+                printf("Cannot save the RP-Tree to %s\n", index_path);
+            }
+        });
+        printf("RP-Tree compaction started in the background\n");
+    }
+    printf("RP-Tree successfully updated after deletion\n");
+}
+
+/**
+ * @fn void RPTreeIndex::finish_compaction()
+ * @brief Waits until a background compaction is published and saved.
+ *
+ * The compaction uses the training set and the statics of the class, so
+ * it must end before main returns and they are destroyed.
+ */
+void RPTreeIndex::finish_compaction()
+{
+    // The compaction takes publishing to publish, so it is not held while waiting
+    future<void> pending;
+    {
+        lock_guard<mutex> guard(publishing);
+        pending = move(rebuilding);
+    }
+    if(pending.valid())
+    {
+        printf("Waiting for the RP-Tree compaction to finish\n");
+        pending.wait();
+    }
+}
+
+// Expanded distances smaller than this share of |x|^2 + |q|^2 may be mostly
+// rounding error, so they are computed again from the differences
+static const double cancellation_guard = sizeof(scalar_t) == sizeof(float) ? 1e-3 : 1e-9;
+
+// Points of a leaf whose dot products are taken together
+static const int scan_batch = 64;
+
+/**
+ * @fn void TreeIndex::scan_leaf(const int* points, int count, const scalar_t* q, double q_norm, TopK& nearest, visited_set* seen)
+ * @brief Offers the points of a leaf to the k nearest neighbours found so far.
+ *
+ * A point is skipped without reading its row when the difference of its
+ * norm and the norm of q already reaches the kth best distance.
+ *
+ * @param points The indices of the points.
+ * @param count The number of points.
+ * @param q The query, padded to the stride of the dataset.
+ * @param q_norm The squared norm of q.
+ * @param nearest The neighbours found so far, by squared distance.
+ * @param seen The points already offered, which are skipped, or NULL
+ * when no point can be offered twice.
+ */
+void TreeIndex::scan_leaf(const int* points, int count, const scalar_t* q, double q_norm, TopK& nearest, visited_set* seen)
+{
+    const distance_kernels& kernels = distance_kernels::best();
+    int width = view.stride;
+    double q_length = sqrt(q_norm);
+    double worst = nearest.bound();
+
+    auto offer = [&](double distance, int id)
+    {
+        if(nearest.push(distance, id))
+        {
+            worst = nearest.bound();
+        }
+    };
+
+    for(int start = 0; start < count; start += scan_batch)
+    {
+        const scalar_t* rows[scan_batch];
+        int picked[scan_batch];
+        double dots[scan_batch];
+
+        // By the triangle inequality |x - q| >= ||x| - |q||
+        double reach = sqrt(worst);
+        int m = 0;
+        for(int i = start; i < min(count, start + scan_batch); i++)
+        {
+            // Marked even when the norm test rejects it, the kth best only shrinks
+            if(seen != NULL && !seen->insert(points[i]))
+            {
+                continue;
+            }
+            if(abs(sqrt(view.row_norm(points[i])) - q_length) < reach && !view.is_deleted(points[i]))
+            {
+                rows[m] = view.row(points[i]).data();
+                picked[m++] = points[i];
+            }
+        }
+
+        if(!norm_distances)
+        {
+            // Scanning stops as soon as the candidate cannot beat the kth neighbour
+            for(int j = 0; j < m; j++)
+            {
+                offer(kernels.squared_l2_bounded(rows[j], q, scan_order.data(), scan_order.size(), worst), picked[j]);
+            }
+            continue;
+        }
+
+        kernels.dot_rows(rows, m, q, width, dots);
+        for(int j = 0; j < m; j++)
+        {
+            double x_norm = view.row_norm(picked[j]);
+            double distance = x_norm + q_norm - 2 * dots[j];
+            if(distance < cancellation_guard * (x_norm + q_norm))
+            {
+                distance = kernels.squared_l2(rows[j], q, width);
+            }
+            offer(distance, picked[j]);
+        }
+    }
+}
+
+/**
+ * @fn static const scalar_t* padded_query(DataVector& q, int width, vector<scalar_t>& buffer)
+ * @brief Copies a query into buffer, laid out like a row of the dataset and
+ * padded with zeros up to width, so the distance kernels can compare the two.
+ * @return The start of the buffer.
+ */
+static const scalar_t* padded_query(DataVector& q, int width, vector<scalar_t>& buffer)
+{
+    buffer.assign(width, (scalar_t)0);
+    int d = min(width, q.get_the_size());
+    const double* x = q.data();
+    for(int j = 0; j < d; j++)
+    {
+        buffer[j] = x[j];
+    }
+    return buffer.data();
+}
+
+/**
+ * @fn static const scalar_t* padded_query(RowView q, int width, vector<scalar_t>& buffer)
+ * @brief Gives a row of another dataset laid out like a row of this one.
+ *
+ * Rows of the same dimension are padded the same way, so they are used in
+ * place. Other rows are copied into buffer.
+ *
+ * @return The padded query.
+ */
+static const scalar_t* padded_query(RowView q, int width, vector<scalar_t>& buffer)
+{
+    int per_line = distance_kernels::block;
+    if((q.get_the_size() + per_line - 1) / per_line * per_line == width)
+    {
+        return q.data();
+    }
+
+    buffer.assign(width, (scalar_t)0);
+    copy(q.data(), q.data() + min(width, q.get_the_size()), buffer.begin());
+    return buffer.data();
+}
+
+/**
+ * @fn static search_scratch& thread_scratch()
+ * @brief Gives the search scratch of the calling thread.
+ */
+static search_scratch& thread_scratch()
+{
+    static thread_local search_scratch scratch;
+    return scratch;
+}
+
+// Queries a batch task answers before the pool hands out the next task
+static const int queries_per_task = 16;
+
+/**
+ * @fn static void for_queries(int n, const function<void(int)>& body)
+ * @brief Runs body for each of n queries, spread over the shared pool.
+ */
+static void for_queries(int n, const function<void(int)>& body)
+{
+    TaskGroup group;
+    for(int b = 0; b < n; b += queries_per_task)
+    {
+        int e = min(n, b + queries_per_task);
+        group.run([&body, b, e]()
+        {
+            for(int i = b; i < e; i++)
+            {
+                body(i);
+            }
+        });
+    }
+    group.wait();
+}
+
+/**
+ * @fn static void take_neighbours(const TopK& nearest, knn_result& result)
+ * @brief Turns the collector of a finished search into its result, taking
+ * the square root of the k distances that are kept.
+ */
+static void take_neighbours(const TopK& nearest, knn_result& result)
+{
+    nearest.sorted(result);
+    for(double& distance : result.distances)
+    {
+        distance = sqrt(distance);
+    }
+}
+
+/**
+ * @fn void TopK::reset(int k)
+ * @brief Empties the collector and makes room for k entries.
+ * @param k The number of entries kept.
+ */
+void TopK::reset(int k)
+{
+    this->k = max(k, 0);
+    n = 0;
+    heap = k > sorted_up_to;
+    if((int)dist.size() < this->k)
+    {
+        dist.resize(this->k);
+        id.resize(this->k);
+    }
+}
+
+/**
+ * @fn void TopK::sift_down(int i, double d, int x)
+ * @brief Puts an entry at slot i of the heap and moves it down to its place.
+ */
+void TopK::sift_down(int i, double d, int x)
+{
+    while(2 * i + 1 < n)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < n && dist[child + 1] > dist[child])
+        {
+            child++;
+        }
+        if(dist[child] <= d)
+        {
+            break;
+        }
+        dist[i] = dist[child];
+        id[i] = id[child];
+        i = child;
+    }
+    dist[i] = d;
+    id[i] = x;
+}
+
+/**
+ * @fn void TopK::merge(const TopK& other)
+ * @brief Offers every entry of another collector.
+ * @param other The other collector.
+ */
+void TopK::merge(const TopK& other)
+{
+    for(int i = 0; i < other.n; i++)
+    {
+        push(other.dist[i], other.id[i]);
+    }
+}
+
+/**
+ * @fn void TopK::sorted(knn_result& result) const
+ * @brief Copies the entries out, smallest distance first, leaving the collector as it is.
+ * @param result The entries.
+ */
+void TopK::sorted(knn_result& result) const
+{
+    result.distances.assign(dist.begin(), dist.begin() + n);
+    result.ids.assign(id.begin(), id.begin() + n);
+    if(!heap)
+    {
+        return;
+    }
+
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        return dist[a] < dist[b] || (dist[a] == dist[b] && id[a] < id[b]);
+    });
+    for(int i = 0; i < n; i++)
+    {
+        result.distances[i] = dist[order[i]];
+        result.ids[i] = id[order[i]];
+    }
+}
+
+/**
+ * @class NullSink
+ * @brief Drops every result.
+ */
+class NullSink : public ResultSink
+{
+public:
+    void write(int query, int k, const knn_result& result) {}
+};
+
+/**
+ * @class TextSink
+ * @brief Writes the ids and distances of every result as text.
+ */
+class TextSink : public ResultSink
+{
+    FILE* out;
+
+public:
+    TextSink(FILE* out) : out(out) {}
+
+    ~TextSink()
+    {
+        if(out != stdout)
+        {
+            fclose(out);
+        }
+    }
+
+    void write(int query, int k, const knn_result& result)
+    {
+        fprintf(out, "query %d\n", query);
+        for(int i = 0; i < result.size(); i++)
+        {
+            fprintf(out, "%d %.2lf\n", result.ids[i], result.distances[i]);
+        }
+    }
+};
+
+/**
+ * @class BinarySink
+ * @brief Writes every result in the binary result format.
+ */
+class BinarySink : public ResultSink
+{
+    FILE* out;
+
+public:
+    BinarySink(FILE* out) : out(out)
+    {
+        fwrite("KNNRSLT", 1, 8, out);
+    }
+
+    ~BinarySink()
+    {
+        if(out != stdout)
+        {
+            fclose(out);
+        }
+        else
+        {
+            fflush(out);
+        }
+    }
+
+    void write(int query, int k, const knn_result& result)
+    {
+        int32_t head[2] = {query, result.size()};
+        fwrite(head, sizeof(int32_t), 2, out);
+        fwrite(result.ids.data(), sizeof(int32_t), result.size(), out);
+        fwrite(result.distances.data(), sizeof(double), result.size(), out);
+    }
+};
+
+/**
+ * @class VectorSink
+ * @brief Prints every neighbour in full, the way the tool always did.
+ */
+class VectorSink : public ResultSink
+{
+    FILE* out;
+
+public:
+    VectorSink(FILE* out) : out(out) {}
+
+    ~VectorSink()
+    {
+        if(out != stdout)
+        {
+            fclose(out);
+        }
+    }
+
+    void write(int query, int k, const knn_result& result)
+    {
+        shared_ptr<VectorDataset> data = TreeIndex::SharedDataset();
+        if(data == NULL)
+        {
+            fprintf(out, "The training set could not be read\n");
+            return;
+        }
+
+        // The neighbours are rows the dataset may be growing away from
+        VectorDataset& D = *data;
+        shared_lock<shared_mutex> layout(TreeIndex::layout_lock);
+        if(D.row_size() < k)
+        {
+            fprintf(out, "There are only %d vectors in the dataset\n", D.row_size());
+            fprintf(out, "Therefore the %d nearest neighbours are :-\n", D.row_size());
+        }
         else
         {
-            temp_right->push_back(a->at(i));
+            fprintf(out, "The %d nearest neighbours of vector with index %d are :-\n", k, query);
+        }
+
+        for(int i = 0; i < result.size(); i++)
+        {
+            RowView row = D.row(result.ids[i]);
+            fprintf(out, "Distance: %.2lf \nVector: \n", result.distances[i]);
+            for(int j = 0; j < row.get_the_size(); j++)
+            {
+                fprintf(out, "%.2lf ", row.get_element(j));
+            }
+            fprintf(out, "\n ------------------------------ \n");
         }
+        fprintf(out, " ===========================\n===========================\n\n");
     }
+};
 
-    if(temp_left->empty())
+/**
+ * @fn static shared_ptr<ResultSink> ResultSink::open(const char* mode, const char* path)
+ * @brief Creates a built in sink.
+ * @param mode "none", "text", "binary" or "vectors".
+ * @param path The file to write to, NULL for standard output.
+ * @return The sink, or NULL if the mode is unknown or the file could not be opened.
+ */
+shared_ptr<ResultSink> ResultSink::open(const char* mode, const char* path)
+{
+    if(strcmp(mode, "none") == 0)
     {
-        temp->left = NULL;
+        return make_shared<NullSink>();
     }
-    else if(temp_left->size() == 1)
+
+    bool binary = strcmp(mode, "binary") == 0;
+    if(!binary && strcmp(mode, "text") != 0 && strcmp(mode, "vectors") != 0)
     {
-        struct rp_tree_node* templ = new rp_tree_node();
-        templ->indices.insert(templ->indices.end(), temp_left->begin(), temp_left->end());
-        templ->height = temp->height + 1;
-        templ->median_vector.random_vector(max_cols);
-        templ->median = (D.access_row(templ->indices[0]) * templ->median_vector);
+        return NULL;
+    }
 
-        templ->left = NULL;
-        templ->right = NULL;
+    FILE* out = stdout;
+    if(path != NULL)
+    {
+        out = fopen(path, binary ? "wb" : "w");
+        if(out == NULL)
+        {
+            return NULL;
+        }
+    }
 
-        temp->left = templ;
+    if(binary)
+    {
+        return make_shared<BinarySink>(out);
     }
-    else
+    if(strcmp(mode, "text") == 0)
+    {
+        return make_shared<TextSink>(out);
+    }
+    return make_shared<VectorSink>(out);
+}
+
+shared_ptr<ResultSink> TreeIndex::result_sink = ResultSink::open("text", NULL);
+
+/**
+ * @fn void KDTreeIndex::kd_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+ * @brief Finds the k nearest neighbours of q.
+ *
+ * The search is best-bin-first. It walks down to a leaf, queueing the far
+ * side of every split on the way, and then carries on from the queued
+ * subtree nearest to q. A subtree's bound adds up how far q lies outside
+ * its cell along every split axis, so it is much tighter than the distance
+ * to the last splitting plane alone. Once the nearest queued subtree is no
+ * closer than the kth best distance the result is exact. With max_checks
+ * set, the search also stops after that many distances and returns the
+ * best found so far.
+ *
+ * @param q The query, padded to the stride of the dataset.
+ * @param k The number of neighbours.
+ * @param scratch The working memory of the calling thread.
+ * @param result The neighbours found.
+ */
+void KDTreeIndex::kd_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+{
+    result.ids.clear();
+    result.distances.clear();
+    if(k <= 0 || view.rows == 0)
     {
-        temp->left = new_rp_node(temp_left, temp->height + 1);
+        return;
     }
-    
 
-    if(temp_right->empty())
+    const distance_kernels& kernels = distance_kernels::best();
+    double q_norm = kernels.dot(q, q, view.stride);
+
+    // The k nearest neighbors, by squared distance
+    TopK& nearest_neighbors = scratch.nearest;
+    nearest_neighbors.reset(k);
+
+    // Subtrees left for later, nearest on top
+    vector<search_branch>& branches = scratch.queue;
+    vector<cell_offset>& offsets = scratch.offsets;
+    branches.clear();
+    offsets.clear();
+    branches.push_back({0.0, 0, -1});
+
+    int checks = 0;
+    while(!branches.empty())
     {
-        temp->right = NULL;
+        pop_heap(branches.begin(), branches.end());
+        search_branch next = branches.back();
+        branches.pop_back();
+
+        // Nothing left can beat the current kth neighbour, or the budget is spent
+        if(next.bound >= nearest_neighbors.bound() || (max_checks > 0 && checks >= max_checks))
+        {
+            break;
+        }
+
+        int node = next.node;
+        while(!nodes[node].is_leaf())
+        {
+            const flat_node& temp = nodes[node];
+            double diff = q[temp.axis] - temp.split;
+
+            // Decide which child node to visit first
+            int first = temp.child;
+            int second = temp.child + 1;
+            if(diff > 0)
+            {
+                swap(first, second);
+            }
+
+            // The far child replaces the offset of its axis, if the path had one
+            double previous = 0;
+            for(int o = next.path; o >= 0; o = offsets[o].prev)
+            {
+                if(offsets[o].axis == temp.axis)
+                {
+                    previous = offsets[o].squared;
+                    break;
+                }
+            }
+
+            double bound = next.bound - previous + diff * diff;
+            if(bound < nearest_neighbors.bound())
+            {
+                offsets.push_back({temp.axis, next.path, diff * diff});
+                branches.push_back({bound, second, (int)offsets.size() - 1});
+                push_heap(branches.begin(), branches.end());
+            }
+            node = first;
+        }
+
+        const flat_node& leaf = nodes[node];
+        scan_leaf(ids.run(leaf.child, leaf.leaf_count(), scratch.leaf), leaf.leaf_count(), q, q_norm, nearest_neighbors);
+        checks += leaf.leaf_count();
     }
-    else if(temp_right->size() == 1)
+
+    take_neighbours(nearest_neighbors, result);
+}
+
+/**
+ * @fn vector<knn_result> KDTreeIndex::kd_batch(VectorDataset& queries, int k)
+ * @brief Finds the k nearest neighbours of every query, in parallel on the shared pool.
+ * @param queries The queries.
+ * @param k The number of neighbours.
+ * @return The neighbours of every query.
+ */
+vector<knn_result> KDTreeIndex::kd_batch(VectorDataset& queries, int k)
+{
+    vector<knn_result> results(queries.row_size());
+    for_queries(queries.row_size(), [&](int i)
+    {
+        search_scratch& scratch = thread_scratch();
+        const scalar_t* q = padded_query(queries.row(i), view.stride, scratch.query);
+        kd_search(q, k, scratch, results[i]);
+    });
+    return results;
+}
+
+/**
+ * @fn knn_result KDTreeIndex::kd_neighbours(int k, DataVector q, int count)
+ * @brief Finds the k nearest neighbours of q and writes them to the result sink.
+ * @param k The number of neighbours.
+ * @param q The query vector.
+ * @param count The index of the query, passed to the sink.
+ * @return The neighbours found.
+ */
+knn_result KDTreeIndex::kd_neighbours(int k, DataVector q, int count)
+{
+    search_scratch& scratch = thread_scratch();
+    knn_result result;
+    kd_search(padded_query(q, view.stride, scratch.query), k, scratch, result);
+    result_sink->write(count, k, result);
+    return result;
+}
+
+void KDTreeIndex::knn_kd()
+{
+    int k;
+    printf("Enter the value of k\n");
+    cin >> k;
+
+    VectorDataset queries;
+    if(queries.ReadCSV("fmnist-test.csv"))
     {
-        struct rp_tree_node* tempr = new rp_tree_node();
-        tempr->indices.insert(tempr->indices.end(), temp_right->begin(), temp_right->end());
-        tempr->height = temp->height + 1;
-        tempr->median_vector.random_vector(max_cols);
-        tempr->median = (D.access_row(tempr->indices[0]) * tempr->median_vector);
+        printf("File opened successfully\n");
+
+        // Only the search is timed, the whole file is answered in parallel
+        auto start = chrono::high_resolution_clock::now();
+        vector<knn_result> results = kd_batch(queries, k);
+        auto end = chrono::high_resolution_clock::now();
 
-        tempr->left = NULL;
-        tempr->right = NULL;
+        for(int i = 0; i < queries.row_size(); i++)
+        {
+            result_sink->write(i, k, results[i]);
+        }
 
-        temp->right = tempr;
+        auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
+        printf("Time taken to find the nearest neighbours using KD-Tree is: %ld ms\n", duration.count() / 1000);
+        printf("Average time per query: %.1lf us\n\n", (double)duration.count() / max(queries.row_size(), 1));
     }
-    else
+    else printf("File not found !!\n");
+}
+
+/**
+ * @fn void RPTreeIndex::rp_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+ * @brief Finds the k nearest neighbours of q.
+ *
+ * Distances are only computed for the points of the leaves reached, and
+ * are ranked squared so that only the k reported ones need a square root.
+ * The projection directions have unit length, so the distance from q to a
+ * splitting hyperplane bounds the distance to everything on its far side.
+ *
+ * A single tree is searched exactly. A forest follows q down to one leaf
+ * in every tree and ranks the union of those leaves by exact distance,
+ * each point once even when several trees put it next to q.
+ *
+ * @param q The query, padded to the stride of the dataset.
+ * @param k The number of neighbours.
+ * @param scratch The working memory of the calling thread.
+ * @param result The neighbours found.
+ */
+void RPTreeIndex::rp_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+{
+    result.ids.clear();
+    result.distances.clear();
+    if(k <= 0 || view.rows == 0)
+    {
+        return;
+    }
+
+    const distance_kernels& kernels = distance_kernels::best();
+    int width = view.stride;
+    double q_norm = kernels.dot(q, q, width);
+
+    // The k nearest neighbors, by squared distance
+    TopK& nearest_neighbors = scratch.nearest;
+    nearest_neighbors.reset(k);
+
+    if(forest.size() > 1)
     {
-        temp->right = new_rp_node(temp_right, temp->height + 1);
+        scratch.visited.clear(view.rows);
+        for(const rp_tree& tree : forest)
+        {
+            int node = 0;
+            while(!tree.nodes[node].is_leaf())
+            {
+                const flat_node& temp = tree.nodes[node];
+                node = temp.child + (rp_project(tree, temp.axis, q, width, kernels) > temp.split);
+            }
+
+            const flat_node& leaf = tree.nodes[node];
+            scan_leaf(tree.ids.run(leaf.child, leaf.leaf_count(), scratch.leaf), leaf.leaf_count(), q, q_norm, nearest_neighbors, &scratch.visited);
+        }
+
+        take_neighbours(nearest_neighbors, result);
+        return;
     }
 
-    delete temp_vector;
-    delete temp_right;
-    delete temp_left;
+    const rp_tree& tree = forest[0];
+
+    // Stack for the nodes to visit, with a lower bound on their squared distance to q
+    vector<pair<int, double>>& nodes_to_visit = scratch.stack;
+    nodes_to_visit.clear();
+    nodes_to_visit.push_back(make_pair(0, 0.0));
+
+    while(!nodes_to_visit.empty())
+    {
+        const flat_node& temp = tree.nodes[nodes_to_visit.back().first];
+        double bound = nodes_to_visit.back().second;
+        nodes_to_visit.pop_back();
+
+        // Nothing in this subtree can beat the current kth neighbour
+        if(bound >= nearest_neighbors.bound())
+        {
+            continue;
+        }
+
+        // Only leaves hold vectors
+        if(temp.is_leaf())
+        {
+            scan_leaf(tree.ids.run(temp.child, temp.leaf_count(), scratch.leaf), temp.leaf_count(), q, q_norm, nearest_neighbors);
+            continue;
+        }
+
+        double diff = rp_project(tree, temp.axis, q, width, kernels) - temp.split;
+
+        // Decide which child node to visit first
+        int first = temp.child;
+        int second = temp.child + 1;
+        if(diff > 0)
+        {
+            swap(first, second);
+        }
+
+        // The far child is pushed first so that the near one is visited first
+        nodes_to_visit.push_back(make_pair(second, max(bound, diff * diff)));
+        nodes_to_visit.push_back(make_pair(first, bound));
+    }
 
-    return temp;    
+    take_neighbours(nearest_neighbors, result);
 }
 
-RPTreeIndex::RPTreeIndex()
+/**
+ * @fn vector<knn_result> RPTreeIndex::rp_batch(VectorDataset& queries, int k)
+ * @brief Finds the k nearest neighbours of every query, in parallel on the shared pool.
+ * @param queries The queries.
+ * @param k The number of neighbours.
+ * @return The neighbours of every query.
+ */
+vector<knn_result> RPTreeIndex::rp_batch(VectorDataset& queries, int k)
 {
-    auto start = chrono::high_resolution_clock::now();
-
-    // Creating a root node
-    struct rp_tree_node* temp = new rp_tree_node();
-
-    // Sending the all the indices in the DataSet
-    for(int i=0; i<D.row_size(); i++)
+    vector<knn_result> results(queries.row_size());
+    for_queries(queries.row_size(), [&](int i)
     {
-        temp->indices.push_back(i);
-    }
-
-    // Height is 0 since it the root
-    temp->height = 0;
+        search_scratch& scratch = thread_scratch();
+        const scalar_t* q = padded_query(queries.row(i), view.stride, scratch.query);
+        rp_search(q, k, scratch, results[i]);
+    });
+    return results;
+}
 
-    temp->median_vector.random_vector(max_cols);
+/**
+ * @fn knn_result RPTreeIndex::rp_neighbours(int k, DataVector q, int count)
+ * @brief Finds the k nearest neighbours of q and writes them to the result sink.
+ * @param k The number of neighbours.
+ * @param q The query vector.
+ * @param count The index of the query, passed to the sink.
+ * @return The neighbours found.
+ */
+knn_result RPTreeIndex::rp_neighbours(int k, DataVector q, int count)
+{
+    search_scratch& scratch = thread_scratch();
+    knn_result result;
+    rp_search(padded_query(q, view.stride, scratch.query), k, scratch, result);
+    result_sink->write(count, k, result);
+    return result;
+}
 
-    vector<double>* temp_vector = new vector<double>();
+void RPTreeIndex::knn_rp()
+{
+    int k;
+    printf("Enter the value of k\n");
+    cin >> k;
 
-    for(int i = 0; i < D.row_size(); i++)
+    VectorDataset queries;
+    if(queries.ReadCSV("fmnist-test.csv"))
     {
-        temp_vector->push_back((D.access_row(i) * temp->median_vector));
-    }
+        printf("File opened successfully\n");
 
-    sort(temp_vector->begin(), temp_vector->end());
+        // Only the search is timed, the whole file is answered in parallel
+        auto start = chrono::high_resolution_clock::now();
+        vector<knn_result> results = rp_batch(queries, k);
+        auto end = chrono::high_resolution_clock::now();
 
-    // Finding the median
-    if(temp_vector->size() % 2 == 0)
-    {
-        temp->median = (temp_vector->at(temp_vector->size()/2) + temp_vector->at(temp_vector->size()/2 - 1)) / 2;
-    }
-    else
-    {
-        temp->median = temp_vector->at(temp_vector->size()/2);
-    }
+        for(int i = 0; i < queries.row_size(); i++)
+        {
+            result_sink->write(i, k, results[i]);
+        }
 
-    vector<int>* temp_left = new vector<int>();
-    vector<int>* temp_right = new vector<int>();
+        auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
+        printf("Time taken to find the nearest neighbours using RP-Tree is: %ld ms\n", duration.count() / 1000);
+        printf("Average time per query: %.1lf us\n\n", (double)duration.count() / max(queries.row_size(), 1));
+    }
+    else printf("File not found !!\n");
+}
 
-    for(int i = 0; i< D.row_size(); i++)
+/**
+ * @fn static knn_result brute_force(VectorDataset& D, VectorDataset& queries, int q, int k)
+ * @brief Finds the k nearest neighbours of a query by measuring every row that is not deleted.
+ * @param D The training set, which nothing may change meanwhile.
+ * @param queries The queries.
+ * @param q The index of the query.
+ * @param k The number of neighbours.
+ * @return The neighbours, nearest first.
+ */
+static knn_result brute_force(VectorDataset& D, VectorDataset& queries, int q, int k)
+{
+    vector<pair<double, int>> all;
+    for(int i = 0; i < D.row_size(); i++)
     {
-        if((D.access_row(i) * temp->median_vector) <= temp->median)
+        if(D.is_deleted(i))
         {
-            temp_left->push_back(temp->indices[i]);
+            continue;
         }
-        else
+        double sum = 0;
+        for(int j = 0; j < D.dimension(); j++)
         {
-            temp_right->push_back(temp->indices[i]);
+            double x = D.access_element(i, j) - queries.access_element(q, j);
+            sum += x * x;
         }
+        all.push_back(make_pair(sqrt(sum), i));
     }
 
-    if(temp_left->empty())
+    int count = min(k, (int)all.size());
+    partial_sort(all.begin(), all.begin() + count, all.end());
+    knn_result result;
+    for(int t = 0; t < count; t++)
     {
-        temp->left = NULL;
+        result.ids.push_back(all[t].second);
+        result.distances.push_back(all[t].first);
     }
-    else if(temp_left->size() == 1)
-    {
-        struct rp_tree_node* templ = new rp_tree_node();
-        templ->indices.insert(templ->indices.end(), temp_left->begin(), temp_left->end());
-        templ->height = temp->height + 1;
-        templ->median_vector.random_vector(max_cols);
-        templ->median = (D.access_row(templ->indices[0]) * templ->median_vector);
-
-        templ->left = NULL;
-        templ->right = NULL;
-
-        temp->left = templ;
-    }
-    else
-    {
-        temp->left = new_rp_node(temp_left, temp->height + 1);
-    }
-    
+    return result;
+}
 
-    if(temp_right->empty())
-    {
-        temp->right = NULL;
-    }
-    else if(temp_right->size() == 1)
+/**
+ * @fn static bool same_neighbours(VectorDataset& D, const knn_result& result, const knn_result& exact)
+ * @brief Checks that a search found neighbours as near as the exact ones.
+ *
+ * Rows at the same distance may come in either order, so the distances
+ * are compared rather than the indices.
+ */
+static bool same_neighbours(VectorDataset& D, const knn_result& result, const knn_result& exact)
+{
+    if(result.size() != exact.size())
     {
-        struct rp_tree_node* tempr = new rp_tree_node();
-        tempr->indices.insert(tempr->indices.end(), temp_right->begin(), temp_right->end());
-        tempr->height = temp->height + 1;
-        tempr->median_vector.random_vector(max_cols);
-        tempr->median = (D.access_row(tempr->indices[0]) * tempr->median_vector);
-
-        tempr->left = NULL;
-        tempr->right = NULL;
-
-        temp->right = tempr;
+        return false;
     }
-    else
+    for(int t = 0; t < result.size(); t++)
     {
-        temp->right = new_rp_node(temp_right, temp->height + 1);
+        if(fabs(result.distances[t] - exact.distances[t]) > 1e-2 || D.is_deleted(result.ids[t]))
+        {
+            return false;
+        }
     }
-     
-    root = temp;
-    printf("RP-Tree successfully built\n");
-    delete temp_vector;
-    delete temp_left;
-    delete temp_right;
-
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
-    printf("Time taken to build RP-Tree: %ld ms\n\n", duration.count());
+    return true;
 }
 
-void delete_rp_tree(struct rp_tree_node*& head)
+/**
+ * @fn static bool check_kd_search()
+ * @brief Compares the best-bin-first KD-Tree search without a check budget with a brute force scan.
+ *
+ * Needs the training set and fmnist-test.csv. Without a budget the search
+ * only stops once no cell can hold a closer point, so it must be exact.
+ *
+ * @return True if every query got its exact neighbours.
+ */
+static bool check_kd_search()
 {
-    if(head == NULL)
+    VectorDataset queries;
+    if(!queries.ReadCSV("fmnist-test.csv"))
     {
-        return;
+        printf("File not found !!\n");
+        return false;
     }
 
-    delete_rp_tree(head->left);
-    delete_rp_tree(head->right);
-    delete head;
-
-    head = NULL;
-}
-
-void RPTreeIndex::add_rp_vector(DataVector temp)
-{
-    int d = temp.get_the_size();
+    KDTreeIndex::max_checks = 0;
+    VectorDataset& D = *TreeIndex::SharedDataset();
+    int k = 10;
+    vector<knn_result> results = KDTreeIndex::GetInstance()->kd_batch(queries, k);
 
-    if(d > max_cols)
+    int wrong = 0;
+    for(int q = 0; q < queries.row_size(); q++)
     {
-        printf("Dimension exceeds the maximum dimension\n");
-        return;
+        wrong += !same_neighbours(D, results[q], brute_force(D, queries, q, k));
     }
+    printf("KD-Tree queries: %d, wrong answers: %d\n", queries.row_size(), wrong);
+    return wrong == 0;
+}
 
-    TreeIndex::GetInstance().add_datavector(temp);
+// Least recall@10 the forest must reach on the test queries, which 8 trees clear easily
+static const double forest_recall_floor = 0.9;
 
-    ofstream file("fmnist-train.csv", ios::app);
-    if (!file.is_open()) {
-        cout << "Failed to open the file." << endl;
-        return; // Exit if file not opened successfully
+/**
+ * @fn static bool check_forest()
+ * @brief Measures the recall of an RP forest against a brute force scan.
+ *
+ * Needs the training set and fmnist-test.csv. A single tree is exact, so
+ * without --rp-trees a forest of 8 trees is built. It must find at least
+ * forest_recall_floor of the true 10 nearest neighbours.
+ *
+ * @return True if the recall is high enough.
+ */
+static bool check_forest()
+{
+    VectorDataset queries;
+    if(!queries.ReadCSV("fmnist-test.csv"))
+    {
+        printf("File not found !!\n");
+        return false;
     }
 
-    // Write the elements of the vector to the file
-    for (int i = 0; i < d; i++) {
-        if(i != max_cols-1) file << fixed << setprecision(1) << temp.get_element(i) << ",";
-        else file << fixed << setprecision(1) << temp.get_element(i); 
+    if(RPTreeIndex::trees <= 1)
+    {
+        RPTreeIndex::trees = 8;
     }
+    VectorDataset& D = *TreeIndex::SharedDataset();
+    int k = 10;
+    vector<knn_result> results = RPTreeIndex::GetInstance()->rp_batch(queries, k);
 
-    // Fill the remaining positions with 0.0 if the vector size is less than max_cols
-    for (int i = d; i < max_cols; i++) {
-        if(i != max_cols-1) file << fixed << setprecision(1) << 0.0 << ",";
-        else file << fixed << setprecision(1) << 0.0;
+    int found = 0, total = 0;
+    for(int q = 0; q < queries.row_size(); q++)
+    {
+        knn_result exact = brute_force(D, queries, q, k);
+        for(int id : results[q].ids)
+        {
+            found += count(exact.ids.begin(), exact.ids.end(), id) > 0;
+        }
+        total += exact.size();
     }
-    file << "\n"; // Add a newline character at the end of the line
-
-    // Close the file
-    file.close();
-
-    delete_rp_tree(RPTreeIndex::root);
-
-    RPTreeIndex::rpinstance = nullptr;
-    printf("RP-Tree successfully updated on addition\n");
+    double recall = total > 0 ? (double)found / total : 1.0;
+    printf("RP-Forest of %d trees, recall@%d: %.3lf\n", RPTreeIndex::trees, k, recall);
+    return recall >= forest_recall_floor;
 }
 
-void RPTreeIndex::delete_rp_vector(int d)
+/**
+ * @fn static bool stress_test(int updates)
+ * @brief Adds and deletes training rows while both trees are searched, then checks the trees are exact.
+ *
+ * One thread searches the KD-Tree and one the RP-Tree without a pause,
+ * while the main thread adds noisy copies of the test queries and another
+ * thread deletes random rows. The deletes pass the compaction threshold,
+ * so background rebuilds get published during the run as well. Afterwards
+ * every test query is answered by both trees and compared to a brute
+ * force scan. Nothing is written to the mutation log or the index files.
+ * Building with -fsanitize=thread makes this a race check of the update
+ * and publication paths:
+ *   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread TreeIndex.cpp -o TreeIndex-tsan
+ *   ./TreeIndex-tsan --stress 400
+ *
+ * @param updates The number of rows added, and of rows deleted.
+ * @return True if every answer matched the brute force scan.
+ */
+static bool stress_test(int updates)
 {
-
-    if(d > D.row_size())
+    if(KDTreeIndex::max_checks != 0 || RPTreeIndex::trees != 1)
     {
-        return;
+        printf("The stress test needs exact trees, without --checks or --rp-trees\n");
+        return false;
     }
 
-    // D.erase_vector(d);
-
-    // ofstream file("fmnist-train.csv", ios::trunc);
-    
-    // if (!file.is_open()) {
-    //     cout << "Failed to open the file." << endl;
-    //     return; // Exit if file not opened successfully
-    // }
-
-    // // Write the elements of the vector to the file
-    // for (int i = 0; i < D.row_size(); i++) {
-    //     for (int j = 0; j < D.access_row(i).get_the_size(); j++) {
-    //         if(j != max_cols-1) file << fixed << setprecision(1) << D.access_element(i, j) << ",";
-    //         else file << fixed << setprecision(1) << D.access_element(i, j);
-    //     }
-    //     file << "\n"; // Add a newline character at the end of the line
-    // }
-
-    // // Close the file
-    // file.close();
-
-    delete_rp_tree(RPTreeIndex::root);
+    VectorDataset queries;
+    if(!queries.ReadCSV("fmnist-test.csv") || queries.row_size() == 0)
+    {
+        printf("File not found !!\n");
+        return false;
+    }
 
-    RPTreeIndex::rpinstance = nullptr;
-    printf("RP-Tree successfully updated after deletion\n");
-}
+    // The run's changes stay in memory, the saved dataset and indexes are left alone
+    TreeIndex::mutation_log.reset();
+    KDTreeIndex::index_path = NULL;
+    RPTreeIndex::index_path = NULL;
+    TreeIndex::compaction_threshold = 0.05;
 
-void KDTreeIndex::kd_neighbours(int k, DataVector q, int count)
-{
-    struct kd_tree_node* head = KDTreeIndex::GetInstance().get_root();
+    VectorDataset& D = *TreeIndex::SharedDataset();
+    int rows = D.row_size();
+    int k = 5;
+    KDTreeIndex::GetInstance();
+    RPTreeIndex::GetInstance();
 
-    if(head->indices.size() <k)
+    VectorDataset few;
+    for(int i = 0; i < min(queries.row_size(), 10); i++)
     {
-        printf("There are only %d vectors in the dataset\n", head->indices.size());
-        printf("Therefore the %d nearest neighbours are :-\n", head->indices.size());
+        few.add_vector(queries.access_row(i));
+    }
 
-        for(int i=0; i<head->indices.size(); i++)
+    atomic<bool> done(false);
+    atomic<long long> searches(0);
+    thread kd_reader([&]()
+    {
+        while(!done)
         {
-            D.access_row(head->indices[i]).print_vector();
+            KDTreeIndex::GetInstance()->kd_batch(few, k);
+            searches++;
         }
-    }
-    else if(head->indices.size() == k)
+    });
+    thread rp_reader([&]()
     {
-        printf("The %d nearest neighbours are :-\n", k);
-        for(int i=0; i<head->indices.size(); i++)
+        while(!done)
         {
-            D.access_row(head->indices[i]).print_vector();
+            RPTreeIndex::GetInstance()->rp_batch(few, k);
+            searches++;
         }
-    }
+    });
+    thread deleter([&]()
     {
-        // Priority queue for the k nearest neighbors
-        priority_queue<pair<double, int>> nearest_neighbors;
-
-        // Set for the indices already added to the priority queue
-        set<int> added_indices;
-
-        // Stack for the nodes to visit
-        stack<kd_tree_node*> nodes_to_visit;
-        nodes_to_visit.push(head);
-
-        while(!nodes_to_visit.empty())
+        mt19937 generator(3);
+        for(int t = 0; t < updates; t++)
         {
-            kd_tree_node* temp = nodes_to_visit.top();
-            nodes_to_visit.pop();
-
-            int split_dimension = temp->height % max_cols;
-
-            // Check if the current node's vectors are closer
-            for(int i = 0; i < temp->indices.size(); i++)
-            {
-                if(added_indices.count(temp->indices[i]) > 0)
-                {
-                    // This index has already been added to the priority queue
-                    continue;
-                }
-
-                double distance = (D.access_row(temp->indices[i]) - q).norm();
-                if(nearest_neighbors.size() < k || distance < nearest_neighbors.top().first)
-                {
-                    nearest_neighbors.push(make_pair(distance, temp->indices[i]));
-                    added_indices.insert(temp->indices[i]);
-                    if(nearest_neighbors.size() > k)
-                    {
-                        nearest_neighbors.pop();
-                    }
-                }
-            }
-
-            // Decide which child node to visit first
-            kd_tree_node* first = temp->left;
-            kd_tree_node* second = temp->right;
-            if(q.get_element(split_dimension) > temp->median)
-            {
-                swap(first, second);
-            }
-
-            // Visit the first child node
-            if(first != nullptr)
-            {
-                nodes_to_visit.push(first);
-            }
-
-            // Check if we need to visit the second child node
-            if(second != nullptr && (nearest_neighbors.size() < k || 
-                abs(q.get_element(split_dimension) - temp->median) < nearest_neighbors.top().first))
+            int d = generator() % max(rows, 1);
+            if(TreeIndex::GetInstance().delete_datavector(d))
             {
-                nodes_to_visit.push(second);
+                KDTreeIndex::delete_kd_vector(d);
+                RPTreeIndex::delete_rp_vector(d);
             }
         }
+    });
 
-        // Print the k nearest neighbors
-        printf("The %d nearest neighbours of vector with index %d are :-\n", k, count);
-        while(!nearest_neighbors.empty())
+    mt19937 generator(5);
+    for(int t = 0; t < updates; t++)
+    {
+        DataVector temp(0);
+        for(int j = 0; j < D.dimension(); j++)
+        {
+            temp.input(queries.access_element(t % queries.row_size(), j) + generator() % 7);
+        }
+        int id = TreeIndex::GetInstance().add_datavector(temp);
+        if(id >= 0)
         {
-            printf("Distance: %.2lf \nVector: \n", nearest_neighbors.top().first);
-            D.access_row(nearest_neighbors.top().second).print_vector();
-            printf(" ------------------------------ \n");
-            nearest_neighbors.pop();
+            KDTreeIndex::add_kd_vector(id);
+            RPTreeIndex::add_rp_vector(id);
         }
     }
+    deleter.join();
+    done = true;
+    kd_reader.join();
+    rp_reader.join();
+
+    // The writers are done, so the training set can be read directly for the brute force scan
+    vector<knn_result> kd = KDTreeIndex::GetInstance()->kd_batch(queries, k);
+    vector<knn_result> rp = RPTreeIndex::GetInstance()->rp_batch(queries, k);
+    int wrong = 0;
+    for(int q = 0; q < queries.row_size(); q++)
+    {
+        knn_result exact = brute_force(D, queries, q, k);
+        wrong += !same_neighbours(D, kd[q], exact);
+        wrong += !same_neighbours(D, rp[q], exact);
+    }
+
+    printf("Rows: %d, deleted: %d, searches during updates: %lld, wrong answers: %d\n", D.row_size(), D.deleted_count(), searches.load(), wrong);
+    return wrong == 0;
 }
 
-void KDTreeIndex::knn_kd()
+/**
+ * @fn static bool same_results(const vector<knn_result>& a, const vector<knn_result>& b)
+ * @brief Checks that two batches of searches found the same neighbours.
+ */
+static bool same_results(const vector<knn_result>& a, const vector<knn_result>& b)
 {
-    int k;
-    printf("Enter the value of k\n");
-    cin >> k;
-
-    int i =0;
-    ifstream file("fmnist-test.csv");
-
-    if(file.is_open())
+    if(a.size() != b.size())
     {
-        printf("File opened successfully\n");
-        string line;
-
-        auto start = chrono::high_resolution_clock::now();
-        
-        while(getline(file, line))
+        return false;
+    }
+    for(size_t q = 0; q < a.size(); q++)
+    {
+        if(a[q].ids != b[q].ids)
         {
-            DataVector temp;
-            stringstream ss(line);
-            string value;
-
-            while(getline(ss, value, ','))
-            {
-                temp.input(stod(value));
-            }
-
-            kd_neighbours(k, temp, i);
-            i++;
-            printf(" ===========================\n===========================\n\n");
+            return false;
         }
-        file.close();
-
-        auto end = chrono::high_resolution_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
-        printf("Time taken to find the nearest neighbours using KD-Tree is: %ld ms\n\n", duration.count());
     }
-    else printf("File not found !!\n");
+    return true;
 }
 
-void RPTreeIndex::rp_neighbours(int k, DataVector q, int count)
+/**
+ * @fn static bool check_index_files()
+ * @brief Saves both trees, loads them back, and loads them again from stale and damaged files.
+ *
+ * Needs the training set and fmnist-test.csv. The files are written to
+ * treeindex-check-kd.idx and treeindex-check-rp.idx in the working
+ * directory and removed afterwards. A loaded tree must save to the same
+ * bytes and answer the test queries like the built one. A file whose
+ * fingerprint belongs to other rows, or with a changed byte in a tree
+ * section, must not load.
+ *
+ * @return True if every load behaved as expected.
+ */
+static bool check_index_files()
 {
-        struct rp_tree_node* head = RPTreeIndex::GetInstance().get_root();
-
-    if(head->indices.size() <k)
+    VectorDataset queries;
+    if(!queries.ReadCSV("fmnist-test.csv"))
     {
-        printf("There are only %d vectors in the dataset\n", head->indices.size());
-        printf("Therefore the %d nearest neighbours are :-\n", head->indices.size());
+        printf("File not found !!\n");
+        return false;
+    }
 
-        for(int i=0; i<head->indices.size(); i++)
+    const char* kd_path = "treeindex-check-kd.idx";
+    const char* rp_path = "treeindex-check-rp.idx";
+    const char* again_path = "treeindex-check-again.idx";
+    int k = 10;
+
+    // Changes one byte of a saved file, which must then not load
+    const size_t fingerprint_offset = offsetof(index_header, fingerprint);
+    auto tampered = [](const char* path, size_t offset, const function<bool(const char*)>& loads)
+    {
+        vector<char> bytes = read_bytes(path);
+        if(bytes.size() <= offset)
         {
-            D.access_row(head->indices[i]).print_vector();
+            return false;
         }
+        bytes[offset] ^= 0x10;
+        return write_bytes(path, bytes) && !loads(path);
+    };
+
+    KDTreeIndex& kd = *KDTreeIndex::GetInstance();
+    vector<knn_result> built = kd.kd_batch(queries, k);
+    bool kd_ok = kd.save(kd_path);
+    KDTreeIndex* kd_loaded = kd_ok ? KDTreeIndex::load(kd_path) : NULL;
+    kd_ok = kd_loaded != NULL && kd_loaded->save(again_path) && read_bytes(again_path) == read_bytes(kd_path)
+        && same_results(kd_loaded->kd_batch(queries, k), built);
+    delete kd_loaded;
+    auto kd_loads = [](const char* path)
+    {
+        KDTreeIndex* index = KDTreeIndex::load(path);
+        delete index;
+        return index != NULL;
+    };
+    bool kd_stale = kd_ok && tampered(kd_path, fingerprint_offset, kd_loads);
+    bool kd_damaged = kd_ok && kd.save(kd_path) && tampered(kd_path, read_bytes(kd_path).size() - 1, kd_loads);
+
+    RPTreeIndex& rp = *RPTreeIndex::GetInstance();
+    built = rp.rp_batch(queries, k);
+    bool rp_ok = rp.save(rp_path);
+    RPTreeIndex* rp_loaded = rp_ok ? RPTreeIndex::load(rp_path) : NULL;
+    rp_ok = rp_loaded != NULL && rp_loaded->save(again_path) && read_bytes(again_path) == read_bytes(rp_path)
+        && same_results(rp_loaded->rp_batch(queries, k), built);
+    delete rp_loaded;
+    auto rp_loads = [](const char* path)
+    {
+        RPTreeIndex* index = RPTreeIndex::load(path);
+        delete index;
+        return index != NULL;
+    };
+    bool rp_stale = rp_ok && tampered(rp_path, fingerprint_offset, rp_loads);
+    bool rp_damaged = rp_ok && rp.save(rp_path) && tampered(rp_path, read_bytes(rp_path).size() - 1, rp_loads);
+
+    remove(kd_path);
+    remove(rp_path);
+    remove(again_path);
+    printf("KD-Tree index: round trip %s, stale %s, damaged %s\n", kd_ok ? "ok" : "wrong",
+        kd_stale ? "rejected" : "wrong", kd_damaged ? "rejected" : "wrong");
+    printf("RP-Tree index: round trip %s, stale %s, damaged %s\n", rp_ok ? "ok" : "wrong",
+        rp_stale ? "rejected" : "wrong", rp_damaged ? "rejected" : "wrong");
+    return kd_ok && kd_stale && kd_damaged && rp_ok && rp_stale && rp_damaged;
+}
+
+/**
+ * @fn static bool run_check(const char* name)
+ * @brief Runs one of the feature checks.
+ * @param name The check: kernels or wal, or kd, forest or index on the training set.
+ * @return True if the check passed.
+ */
+static bool run_check(const char* name)
+{
+    if(strcmp(name, "kernels") == 0)
+    {
+        return check_kernels();
     }
-    else if(head->indices.size() == k)
+    if(strcmp(name, "wal") == 0)
     {
-        printf("The %d nearest neighbours are :-\n", k);
-        for(int i=0; i<head->indices.size(); i++)
-        {
-            D.access_row(head->indices[i]).print_vector();
-        }
+        return check_log_replay();
     }
-    else
+    if(TreeIndex::SharedDataset() == NULL)
     {
-        // Priority queue for the k nearest neighbors
-        priority_queue<pair<double, int>> nearest_neighbors;
-
-        // Set for the indices already added to the priority queue
-        set<int> added_indices;
-
-        // Stack for the nodes to visit
-        stack<rp_tree_node*> nodes_to_visit;
-        nodes_to_visit.push(head);
+        return false;
+    }
+    if(strcmp(name, "kd") == 0)
+    {
+        return check_kd_search();
+    }
+    if(strcmp(name, "forest") == 0)
+    {
+        return check_forest();
+    }
+    if(strcmp(name, "index") == 0)
+    {
+        return check_index_files();
+    }
+    printf("Unknown check %s\n", name);
+    return false;
+}
 
-        while(!nodes_to_visit.empty())
+int main(int argc, char* argv[]){
+    // Options come first:
+    //   TreeIndex --threads 8                            threads used to parse, build and search
+    //   TreeIndex --checks 2000                          distances a KD-Tree search may compute, 0 for exact
+    //   TreeIndex --kd-leaf 64                           points per KD-Tree leaf
+    //   TreeIndex --rp-trees 8                           trees in the RP forest, 1 for an exact RP-Tree
+    //   TreeIndex --rp-leaf 64                           points per RP-Tree leaf
+    //   TreeIndex --rp-projection gaussian|sparse        directions the RP-Tree splits along, gaussian by default
+    //   TreeIndex --leaf-scan bounded|norms              how leaf distances are computed, bounded by default
+    //   TreeIndex --rp-seed 42                           seed of the RP-Tree directions, random by default
+    //   TreeIndex --kd-index kd.idx                      file the KD-Tree is loaded from, or saved to once built
+    //   TreeIndex --rp-index rp.idx                      file the RP-Tree is loaded from, or saved to once built
+    //   TreeIndex --compact-at 0.1                       share of deleted points that starts a background rebuild
+    //   TreeIndex --checkpoint-mb 64                     size of the mutation log that is folded into fmnist-train.bin
+    //   TreeIndex --output none|text|binary|vectors      where the neighbours go, text by default
+    //   TreeIndex --output-file results.bin              file for the output instead of stdout
+    const char* output_mode = NULL;
+    const char* output_file = NULL;
+    while(argc >= 3 && strncmp(argv[1], "--", 2) == 0)
+    {
+        if(strcmp(argv[1], "--threads") == 0)
         {
-            rp_tree_node* temp = nodes_to_visit.top();
-            nodes_to_visit.pop();
-
-            // Check if the current node's vectors are closer
-            for(int i = 0; i < temp->indices.size(); i++)
-            {
-                if(added_indices.count(temp->indices[i]) > 0)
-                {
-                    // This index has already been added to the priority queue
-                    continue;
-                }
-
-                double distance = (D.access_row(temp->indices[i]) - q).norm();
-                if(nearest_neighbors.size() < k || distance < nearest_neighbors.top().first)
-                {
-                    nearest_neighbors.push(make_pair(distance, temp->indices[i]));
-                    added_indices.insert(temp->indices[i]);
-                    if(nearest_neighbors.size() > k)
-                    {
-                        nearest_neighbors.pop();
-                    }
-                }
-            }
-
-            // Decide which child node to visit first
-            rp_tree_node* first = temp->left;
-            rp_tree_node* second = temp->right;
-            if((temp->median_vector * q) < temp->median)
-            {
-                swap(first, second);
-            }
-
-            // Visit the first child node
-            if(first != nullptr)
+            ThreadPool::threads = atoi(argv[2]);
+        }
+        else if(strcmp(argv[1], "--checks") == 0)
+        {
+            KDTreeIndex::max_checks = atoi(argv[2]);
+        }
+        else if(strcmp(argv[1], "--kd-leaf") == 0)
+        {
+            KDTreeIndex::leaf_size = atoi(argv[2]);
+        }
+        else if(strcmp(argv[1], "--rp-trees") == 0)
+        {
+            RPTreeIndex::trees = atoi(argv[2]);
+        }
+        else if(strcmp(argv[1], "--rp-leaf") == 0)
+        {
+            RPTreeIndex::leaf_size = atoi(argv[2]);
+        }
+        else if(strcmp(argv[1], "--rp-projection") == 0)
+        {
+            if(strcmp(argv[2], "gaussian") != 0 && strcmp(argv[2], "sparse") != 0)
             {
-                nodes_to_visit.push(first);
+                printf("Unknown projection %s\n", argv[2]);
+                return 1;
             }
-
-            // Check if we need to visit the second child node
-            if(second != nullptr && (nearest_neighbors.size() < k || 
-                abs((temp->median_vector * q) - temp->median) < nearest_neighbors.top().first))
+            RPTreeIndex::sparse_projections = strcmp(argv[2], "sparse") == 0;
+        }
+        else if(strcmp(argv[1], "--leaf-scan") == 0)
+        {
+            if(strcmp(argv[2], "bounded") != 0 && strcmp(argv[2], "norms") != 0)
             {
-                nodes_to_visit.push(second);
+                printf("Unknown leaf scan %s\n", argv[2]);
+                return 1;
             }
+            TreeIndex::norm_distances = strcmp(argv[2], "norms") == 0;
         }
-
-        // Print the k nearest neighbors
-        printf("The %d nearest neighbours of vector with index %d are :-\n", k, count);
-
-        while(!nearest_neighbors.empty())
+        else if(strcmp(argv[1], "--rp-seed") == 0)
+        {
+            RPTreeIndex::seed = strtoul(argv[2], NULL, 10);
+        }
+        else if(strcmp(argv[1], "--kd-index") == 0)
+        {
+            KDTreeIndex::index_path = argv[2];
+        }
+        else if(strcmp(argv[1], "--rp-index") == 0)
+        {
+            RPTreeIndex::index_path = argv[2];
+        }
+        else if(strcmp(argv[1], "--compact-at") == 0)
+        {
+            TreeIndex::compaction_threshold = atof(argv[2]);
+        }
+        else if(strcmp(argv[1], "--checkpoint-mb") == 0)
+        {
+            TreeIndex::checkpoint_bytes = (size_t)atoi(argv[2]) << 20;
+        }
+        else if(strcmp(argv[1], "--output") == 0)
+        {
+            output_mode = argv[2];
+        }
+        else if(strcmp(argv[1], "--output-file") == 0)
+        {
+            output_file = argv[2];
+        }
+        else
         {
-            printf("Distance: %.2lf\n Vector: \n", nearest_neighbors.top().first);
-            D.access_row(nearest_neighbors.top().second).print_vector();
-            printf(" ------------------------------ \n");
-            nearest_neighbors.pop();
+            break;
         }
+        argc -= 2;
+        argv += 2;
     }
-}
-
-void RPTreeIndex::knn_rp()
-{
-    int k;
-    printf("Enter the value of k\n");
-    cin >> k;
 
-    int i =0;
-    ifstream file("fmnist-test.csv");
-
-    if(file.is_open())
+    if(output_mode != NULL || output_file != NULL)
     {
-        printf("File opened successfully\n");
-        string line;
+        TreeIndex::result_sink = ResultSink::open(output_mode != NULL ? output_mode : "text", output_file);
+        if(TreeIndex::result_sink == NULL)
+        {
+            printf("Cannot write %s output to %s\n", output_mode != NULL ? output_mode : "text", output_file != NULL ? output_file : "stdout");
+            return 1;
+        }
+    }
 
-        auto start = chrono::high_resolution_clock::now();
-        
-        while(getline(file, line))
+    // One-shot conversion of a CSV dataset to the binary format:
+    //   TreeIndex --convert fmnist-train.csv fmnist-train.bin
+    if(argc == 4 && strcmp(argv[1], "--convert") == 0)
+    {
+        if(!VectorDataset::ConvertDataset(argv[2], argv[3]))
         {
-            DataVector temp;
-            stringstream ss(line);
-            string value;
+            printf("Conversion of %s to %s failed\n", argv[2], argv[3]);
+            return 1;
+        }
+        return 0;
+    }
 
-            while(getline(ss, value, ','))
-            {
-                temp.input(stod(value));
-            }
+    // Checks of single features, which need no dataset unless they say so:
+    //   TreeIndex --check kernels
+    //   TreeIndex --check wal
+    //   TreeIndex --check kd
+    //   TreeIndex --check forest
+    //   TreeIndex --check index
+    if(argc == 3 && strcmp(argv[1], "--check") == 0)
+    {
+        return run_check(argv[2]) ? 0 : 1;
+    }
 
-            rp_neighbours(k, temp, i);
-            i++;
-            printf(" ===========================\n===========================\n\n");
-        }
-        file.close();
+    if(TreeIndex::SharedDataset() == NULL)
+    {
+        return 1;
+    }
 
-        auto end = chrono::high_resolution_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
-        printf("Time taken to find the nearest neighbours using RP-Tree is: %ld ms\n\n", duration.count());
+    // Concurrent updates and searches, checked against a brute force scan:
+    //   TreeIndex --stress 400
+    if(argc == 3 && strcmp(argv[1], "--stress") == 0)
+    {
+        bool passed = stress_test(atoi(argv[2]));
+        KDTreeIndex::finish_compaction();
+        RPTreeIndex::finish_compaction();
+        return passed ? 0 : 1;
     }
-    else printf("File not found !!\n");
-}
 
-int main(){
     srand(time(NULL));
     int ans = 1;
 
@@ -1244,24 +5759,32 @@ int main(){
                 temp.input(x);
             }
 
-            KDTreeIndex::GetInstance().add_kd_vector(temp);
-            RPTreeIndex::GetInstance().add_rp_vector(temp);
+            // The vector goes into the shared training set once, then both trees are updated
+            int id = TreeIndex::GetInstance().add_datavector(temp);
+            if(id >= 0)
+            {
+                KDTreeIndex::add_kd_vector(id);
+                RPTreeIndex::add_rp_vector(id);
+            }
         }
         else if(choice == 3)
         {
             int serial_no;
             printf("Enter the index of the vector you want to delete\n");
             cin >> serial_no;
-            KDTreeIndex::GetInstance().delete_kd_vector(serial_no);
-            RPTreeIndex::GetInstance().delete_rp_vector(serial_no);
+            if(TreeIndex::GetInstance().delete_datavector(serial_no))
+            {
+                KDTreeIndex::delete_kd_vector(serial_no);
+                RPTreeIndex::delete_rp_vector(serial_no);
+            }
         }
         else if(choice == 4)
         {
-            KDTreeIndex::GetInstance().knn_kd();
+            KDTreeIndex::GetInstance()->knn_kd();
         }
         else if(choice == 5)
         {
-            RPTreeIndex::GetInstance().knn_rp();
+            RPTreeIndex::GetInstance()->knn_rp();
         }
         else if(choice == 0)
         {
@@ -1269,6 +5792,9 @@ int main(){
         }
     }
 
+    // A compaction still running reads the training set, which goes away with main
+    KDTreeIndex::finish_compaction();
+    RPTreeIndex::finish_compaction();
     return 0;
 }
 
@@ -91,6 +91,13 @@ public:
 
     void random_vector(int dimension);
 
+    /**
+     * @fn const double* DataVector::data() const
+     * @brief Gives read-only access to the components of the DataVector.
+     * @return A pointer to the first component.
+     */
+    const double* data() const;
+
     /**
      * @fn void DataVector::print_vector()
      * @brief Prints the components of the DataVector.
@@ -99,15 +106,388 @@ public:
 
 } DataVector;
 
+/**
+ * @typedef scalar_t
+ * @brief The type the dataset matrix is stored in.
+ *
+ * Rows are stored as float by default, which halves the memory of the
+ * dataset. Compile with -DTREEINDEX_DOUBLE to store them as double.
+ */
+#ifdef TREEINDEX_DOUBLE
+typedef double scalar_t;
+#else
+typedef float scalar_t;
+#endif
+
+/**
+ * @class RowView
+ * @brief A non-owning view of one row of a VectorDataset.
+ *
+ * The view points straight into the dataset buffer, so it is only valid
+ * until the dataset is modified.
+ */
+typedef class RowView
+{
+
+const scalar_t* p;
+int n;
+
+public:
+    /**
+     * @fn RowView::RowView(const scalar_t* data, int dimension)
+     * @brief Constructs a view over dimension components starting at data.
+     * @param data The first component of the row.
+     * @param dimension The number of components in the row.
+     */
+    RowView(const scalar_t* data=NULL, int dimension=0) : p(data), n(dimension) {}
+
+    double get_element(int j) const
+    {
+        return p[j];
+    }
+
+    int get_the_size() const
+    {
+        return n;
+    }
+
+    const scalar_t* data() const
+    {
+        return p;
+    }
+
+    /**
+     * @fn double RowView::operator*(const DataVector &other) const
+     * @brief Dot product of the row with a DataVector.
+     * @param other The DataVector to calculate the dot product with.
+     * @return The dot product.
+     */
+    double operator*(const DataVector &other) const;
+
+    /**
+     * @fn double RowView::dot(const double* other) const
+     * @brief Dot product of the row with dimension doubles.
+     * @param other The first of the doubles.
+     * @return The dot product.
+     */
+    double dot(const double* other) const;
+
+    /**
+     * @fn double RowView::distance(const DataVector &other) const
+     * @brief Euclidean distance between the row and a DataVector.
+     * @param other The DataVector to measure the distance to.
+     * @return The distance.
+     */
+    double distance(const DataVector &other) const;
+
+    /**
+     * @fn DataVector RowView::to_datavector() const
+     * @brief Copies the row into a new DataVector.
+     * @return The copy.
+     */
+    DataVector to_datavector() const;
+
+    /**
+     * @fn void RowView::print_vector() const
+     * @brief Prints the components of the row.
+     */
+    void print_vector() const;
+
+} RowView;
+
+/**
+ * @struct distance_kernels
+ * @brief The distance kernels for the best instruction set the CPU supports.
+ *
+ * The kernels compare n components of two scalar_t arrays and allocate
+ * nothing. Rows are padded with zeros up to the stride, so passing the
+ * stride with a query padded the same way lets them run without a tail.
+ *
+ * @var distance_kernels::name
+ * @brief "avx512", "avx2" or "scalar".
+ * @var distance_kernels::squared_l2
+ * @brief The squared Euclidean distance between a and b.
+ * @var distance_kernels::dot
+ * @brief The dot product of a and b.
+ * @var distance_kernels::squared_l2_bounded
+ * @brief The squared Euclidean distance between a and b, summed over the
+ * blocks of block components starting at the given offsets, in that order.
+ * Once the partial sum reaches bound the rest is skipped and the partial
+ * sum returned, so a result at or above bound only means "not closer".
+ * @var distance_kernels::dot_rows
+ * @brief The dot products of count rows with b, into out. Rows are taken
+ * four at a time so that every load of b serves all four.
+ * @var distance_kernels::block
+ * @brief The components in a block, one 64 byte line of a row.
+ */
+struct distance_kernels
+{
+    const char* name;
+    double (*squared_l2)(const scalar_t* a, const scalar_t* b, int n);
+    double (*dot)(const scalar_t* a, const scalar_t* b, int n);
+    double (*squared_l2_bounded)(const scalar_t* a, const scalar_t* b, const int* blocks, int count, double bound);
+    void (*dot_rows)(const scalar_t* const* rows, int count, const scalar_t* b, int n, double* out);
+
+    static constexpr int block = 64 / sizeof(scalar_t);
+
+    /**
+     * @fn static const distance_kernels& distance_kernels::best()
+     * @brief Gives the kernels picked from CPUID on the first call.
+     * @return The kernels.
+     */
+    static const distance_kernels& best();
+};
+
+/**
+ * @class ThreadPool
+ * @brief A pool of worker threads that steal work from each other.
+ *
+ * Every worker has its own queue. It runs its newest task first and, when
+ * its queue is empty, takes the oldest task from another queue. Threads
+ * outside the pool share one more queue. A thread waiting on a TaskGroup
+ * runs queued tasks instead of blocking, so tasks may spawn and wait for
+ * tasks of their own. Once nothing is queued it sleeps like a worker until
+ * a task is queued or its group finishes.
+ *
+ * @var ThreadPool::threads
+ * @brief The number of threads the shared pool uses, counting the thread
+ * that waits on it. 0, the default, uses one per hardware thread.
+ */
+class ThreadPool
+{
+    struct task_queue
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<task_queue>> queues;
+    vector<thread> workers;
+    atomic<int> pending;
+    atomic<bool> stopping;
+    mutex sleep_lock;
+    condition_variable wake;
+
+    static thread_local int current;
+
+    void work(int id);
+
+public:
+    static int threads;
+
+    /**
+     * @fn ThreadPool::ThreadPool(int size)
+     * @brief Starts size - 1 workers, the thread that waits is the last one.
+     * @param size The number of threads running tasks.
+     */
+    ThreadPool(int size);
+
+    /**
+     * @fn ThreadPool::~ThreadPool()
+     * @brief Stops and joins the workers.
+     */
+    ~ThreadPool();
+
+    /**
+     * @fn int ThreadPool::size() const
+     * @brief Gets the number of threads running tasks, counting the waiting thread.
+     * @return The number of threads.
+     */
+    int size() const
+    {
+        return workers.size() + 1;
+    }
+
+    /**
+     * @fn void ThreadPool::submit(function<void()> task)
+     * @brief Queues a task on the calling thread's queue.
+     * @param task The task.
+     */
+    void submit(function<void()> task);
+
+    /**
+     * @fn bool ThreadPool::run_one()
+     * @brief Runs one queued task on the calling thread, stealing if needed.
+     * @return False if there was nothing to run.
+     */
+    bool run_one();
+
+    /**
+     * @fn void ThreadPool::sleep(const atomic<int>& unfinished)
+     * @brief Blocks until a task is queued or unfinished drops to 0.
+     * @param unfinished The task count of the group being waited for.
+     */
+    void sleep(const atomic<int>& unfinished);
+
+    /**
+     * @fn void ThreadPool::wake_all()
+     * @brief Wakes every sleeping thread, after a group's last task finished.
+     */
+    void wake_all();
+
+    /**
+     * @fn static ThreadPool& ThreadPool::shared()
+     * @brief Gives the pool shared by the whole program, started on the first call.
+     * @return The shared pool.
+     */
+    static ThreadPool& shared();
+};
+
+/**
+ * @class TaskGroup
+ * @brief A set of tasks on a ThreadPool that can be waited for together.
+ *
+ * With a single thread in the pool the tasks simply run inline.
+ */
+class TaskGroup
+{
+    ThreadPool& pool;
+    atomic<int> unfinished;
+
+public:
+    TaskGroup(ThreadPool& pool = ThreadPool::shared()) : pool(pool), unfinished(0) {}
+
+    /**
+     * @fn void TaskGroup::run(function<void()> task)
+     * @brief Starts a task of the group.
+     * @param task The task.
+     */
+    void run(function<void()> task);
+
+    /**
+     * @fn void TaskGroup::wait()
+     * @brief Runs queued tasks until every task of the group has finished.
+     */
+    void wait();
+};
+
+/**
+ * @struct dataset_header
+ * @brief The header of the binary dataset format.
+ *
+ * A binary dataset file is this 64 byte header followed by the raw matrix,
+ * rows * stride components of the given dtype, exactly as VectorDataset
+ * keeps it in memory. The matrix starts at header_size, so a file mapped
+ * at a page boundary gives aligned rows without copying anything.
+ */
+struct dataset_header
+{
+    char magic[8];          // "KNNDSET" followed by a zero byte
+    uint32_t version;       // dataset_format_version
+    uint32_t dtype;         // size in bytes of one component, 4 or 8
+    uint64_t rows;
+    uint32_t cols;
+    uint32_t stride;
+    uint32_t alignment;
+    uint32_t header_size;   // offset of the matrix from the start of the file
+    char reserved[24];
+};
+
+static const uint32_t dataset_format_version = 1;
+
+/**
+ * @struct dataset_storage
+ * @brief The memory of a VectorDataset with room for capacity rows.
+ *
+ * Growing the dataset moves it into a bigger storage. Searches hold on to
+ * the storage they started with through a dataset_snapshot, so the old one
+ * is only freed once the last of them is done with it.
+ *
+ * @var dataset_storage::m
+ * @brief The matrix, owned or inside the mapping.
+ * @var dataset_storage::mapping
+ * @brief The memory-mapped binary file backing m, or NULL if m is owned.
+ * @var dataset_storage::norms
+ * @brief The squared norm of every row. Room for every row is reserved up
+ * front, so it never moves while rows are added.
+ * @var dataset_storage::tombstones
+ * @brief One bit per row, set once the row is deleted, sized for every row
+ * the storage can hold.
+ */
+struct dataset_storage
+{
+    scalar_t* m = NULL;
+    void* mapping = NULL;
+    size_t mapping_size = 0;
+    vector<double> norms;
+    vector<uint64_t> tombstones;
+
+    ~dataset_storage();
+};
+
+/**
+ * @struct dataset_snapshot
+ * @brief The rows of a VectorDataset as they were when the snapshot was taken.
+ *
+ * Rows added later are not seen. Rows deleted later are, as long as the
+ * dataset has not moved to another storage since.
+ */
+struct dataset_snapshot
+{
+    shared_ptr<const dataset_storage> storage;
+    const scalar_t* m = NULL;
+    const double* norms = NULL;
+    const uint64_t* tombstones = NULL;
+    int rows = 0;
+    int cols = 0;
+    int stride = 0;
+
+    RowView row(int i) const
+    {
+        return RowView(m + (size_t)i * stride, cols);
+    }
+
+    double row_norm(int i) const
+    {
+        return norms[i];
+    }
+
+    bool is_deleted(int i) const
+    {
+        return __atomic_load_n(&tombstones[(unsigned)i >> 6], __ATOMIC_RELAXED) >> (i & 63) & 1;
+    }
+};
+
 /**
  * @class VectorDataset
  * @brief A class to represent a dataset of vectors.
- * @var VectorDataset::v
- * @brief The vectors in the dataset.
+ *
+ * All rows live in one contiguous, 64-byte aligned buffer of scalar_t.
+ * Every row starts on an aligned boundary, so rows are padded with zeros
+ * up to the stride.
+ *
+ * @var VectorDataset::m
+ * @brief The matrix buffer, rows * stride components, in storage.
+ * @var VectorDataset::rows
+ * @brief The number of vectors in the dataset.
+ * @var VectorDataset::cols
+ * @brief The dimension of the vectors.
+ * @var VectorDataset::stride
+ * @brief The distance in components between two consecutive rows.
+ * @var VectorDataset::capacity
+ * @brief The number of rows the buffer can hold before it has to grow.
+ * @var VectorDataset::storage
+ * @brief The matrix, the norms of the rows and their tombstones. Deleted
+ * rows keep their place, so the indices of the others never change.
+ * @var VectorDataset::deleted
+ * @brief The number of deleted rows.
  */
 typedef class VectorDataset{
 
-    vector<DataVector> v;
+    scalar_t* m;
+    int rows;
+    int cols;
+    int stride;
+    int capacity;
+
+    shared_ptr<dataset_storage> storage;
+    int deleted;
+
+    void move_to(int new_capacity);
+    void reserve(int n);
+    void compute_norms();
+    void detach();
+    void release();
 
     public:
         /**
@@ -122,6 +502,13 @@ typedef class VectorDataset{
          */
         ~VectorDataset();
 
+        /**
+         * @fn VectorDataset::VectorDataset(const VectorDataset &other)
+         * @brief Copy constructor for the VectorDataset class.
+         * @param other The VectorDataset to copy.
+         */
+        VectorDataset(const VectorDataset &other);
+
         /**
          * @fn VectorDataset & VectorDataset::operator=(const VectorDataset &other)
          * @brief Assigns the values from another VectorDataset.
@@ -131,10 +518,57 @@ typedef class VectorDataset{
         VectorDataset & operator=(const VectorDataset &other);
 
         /**
-         * @fn void VectorDataset::ReadDataset()
+         * @fn bool VectorDataset::ReadDataset()
          * @brief Reads the dataset from a file.
+         * @return False if neither file could be read.
+         */
+        bool ReadDataset();
+
+        /**
+         * @fn bool VectorDataset::ReadCSV(const char* path)
+         * @brief Appends every line of a CSV file to the dataset.
+         * @param path The CSV file.
+         * @return False if the file could not be opened.
+         */
+        bool ReadCSV(const char* path);
+
+        /**
+         * @fn bool VectorDataset::WriteDeleted(const char* path)
+         * @brief Writes the indices of the deleted vectors, one per line.
+         * @param path The file.
+         * @return False if the file could not be written.
+         */
+        bool WriteDeleted(const char* path);
+
+        /**
+         * @fn bool VectorDataset::WriteBinary(const char* path)
+         * @brief Writes the dataset in the binary dataset format.
+         * @param path The binary file.
+         * @return False if the file could not be written.
+         */
+        bool WriteBinary(const char* path);
+
+        /**
+         * @fn bool VectorDataset::MapBinary(const char* path)
+         * @brief Replaces the dataset with a memory mapping of a binary dataset file.
+         *
+         * The mapping is read-only and shared, so processes serving the same
+         * file share its pages. The first modification of the dataset copies
+         * it into private memory.
+         *
+         * @param path The binary file.
+         * @return False if the file is missing or was written in another format.
+         */
+        bool MapBinary(const char* path);
+
+        /**
+         * @fn static bool VectorDataset::ConvertDataset(const char* csv_path, const char* bin_path)
+         * @brief Converts a CSV dataset into the binary dataset format.
+         * @param csv_path The CSV file to read.
+         * @param bin_path The binary file to write.
+         * @return False if either file could not be opened.
          */
-        void ReadDataset();
+        static bool ConvertDataset(const char* csv_path, const char* bin_path);
 
         /**
          * @fn int VectorDataset::row_size()
@@ -151,8 +585,83 @@ typedef class VectorDataset{
          */
         DataVector access_row(int i);
 
+        /**
+         * @fn RowView VectorDataset::row(int i) const
+         * @brief Gives a view of a vector at a given index without copying it.
+         * @param i The index.
+         * @return The view.
+         */
+        RowView row(int i) const
+        {
+            return RowView(m + (size_t)i * stride, cols);
+        }
+
+        /**
+         * @fn int VectorDataset::row_stride() const
+         * @brief Gets the number of components of a row, padding included.
+         * @return The stride.
+         */
+        int row_stride() const
+        {
+            return stride;
+        }
+
+        /**
+         * @fn double VectorDataset::row_norm(int i) const
+         * @brief Gets the squared norm of a vector at a given index.
+         * @param i The index.
+         * @return The squared norm.
+         */
+        double row_norm(int i) const
+        {
+            return storage->norms[i];
+        }
+
+        /**
+         * @fn dataset_snapshot VectorDataset::snapshot() const
+         * @brief Takes a snapshot of the rows, which stays readable however the dataset changes.
+         * @return The snapshot.
+         */
+        dataset_snapshot snapshot() const;
+
         double access_element(int i, int j);
 
+        int dimension();
+
+        /**
+         * @fn bool VectorDataset::is_deleted(int i) const
+         * @brief Checks whether the vector at a given index was deleted.
+         *
+         * Safe to call while another thread deletes rows.
+         *
+         * @param i The index.
+         * @return True if the vector was deleted.
+         */
+        bool is_deleted(int i) const
+        {
+            size_t word = (unsigned)i >> 6;
+            return storage != NULL && word < storage->tombstones.size()
+                && (__atomic_load_n(&storage->tombstones[word], __ATOMIC_RELAXED) >> (i & 63) & 1);
+        }
+
+        /**
+         * @fn bool VectorDataset::delete_vector(int i)
+         * @brief Marks the vector at a given index as deleted, in constant time.
+         * @param i The index.
+         * @return False if there is no such vector or it was already deleted.
+         */
+        bool delete_vector(int i);
+
+        /**
+         * @fn int VectorDataset::deleted_count() const
+         * @brief Gets the number of deleted vectors.
+         * @return The number of deleted vectors.
+         */
+        int deleted_count() const
+        {
+            return __atomic_load_n(&deleted, __ATOMIC_RELAXED);
+        }
+
         /**
          * @fn void VectorDataset::add_vector(DataVector vec)
          * @brief Adds a vector to the dataset.
@@ -160,8 +669,6 @@ typedef class VectorDataset{
          */
         void add_vector(DataVector vec);
 
-        void erase_vector(int i);
-
         /**
          * @fn void VectorDataset::print_datavector()
          * @brief Prints the vectors in the dataset.
@@ -170,116 +677,1355 @@ typedef class VectorDataset{
 
 } VectorDataset;
 
-struct kd_tree_node
+/**
+ * @struct log_header
+ * @brief The header of a mutation log file.
+ *
+ * The header is followed by records, each a log_record and then length
+ * bytes of payload: the components of the row in the given dtype, without
+ * padding, for an insert, nothing for a delete.
+ */
+struct log_header
 {
-    vector<int> indices;
-    int height;
-    double median;
+    char magic[8];          // "KNNWAL" followed by two zero bytes
+    uint32_t version;       // log_format_version
+    uint32_t dtype;         // size in bytes of one component, 4 or 8
+    char reserved[16];
+};
 
-    kd_tree_node* left;
-    kd_tree_node* right;
+/**
+ * @struct log_record
+ * @brief The fixed part of a mutation log record.
+ *
+ * @var log_record::checksum
+ * @brief CRC-32 of the rest of the record and its payload. A record that
+ * does not match was torn by a crash, and it ends the log.
+ * @var log_record::type
+ * @brief log_insert or log_delete.
+ * @var log_record::id
+ * @brief The index of the row inserted or deleted.
+ * @var log_record::length
+ * @brief The size of the payload in bytes.
+ */
+struct log_record
+{
+    uint32_t checksum;
+    uint32_t type;
+    int32_t id;
+    uint32_t length;
 };
 
-struct rp_tree_node
+static const uint32_t log_format_version = 1;
+static const uint32_t log_insert = 1;
+static const uint32_t log_delete = 2;
+
+/**
+ * @class MutationLog
+ * @brief Append-only log of the changes made to the training set since its last checkpoint.
+ *
+ * A change is appended as a record and becomes durable once it is
+ * committed. Threads committing at the same time share one write and one
+ * flush to disk: the first writes every record appended so far, the others
+ * wait for it (group commit). At startup the log is replayed on top of the
+ * binary dataset file. A checkpoint writes the dataset back to that file
+ * and empties the log.
+ *
+ * @var MutationLog::path
+ * @brief The log file.
+ * @var MutationLog::file
+ * @brief The log file, open for appending.
+ * @var MutationLog::pending
+ * @brief Records appended but not written yet.
+ * @var MutationLog::appended
+ * @brief The sequence number of the last record appended.
+ * @var MutationLog::durable
+ * @brief The sequence number of the last record on disk.
+ * @var MutationLog::flushing
+ * @brief Whether a thread is writing pending records.
+ * @var MutationLog::bytes
+ * @brief The size of the log file.
+ */
+class MutationLog
 {
-    vector<int> indices;
-    int height;
-    DataVector median_vector;
-    double median;
+    string path;
+    FILE* file;
+    mutex lock;
+    condition_variable flushed;
+    vector<char> pending;
+    uint64_t appended;
+    uint64_t durable;
+    bool flushing;
+    size_t bytes;
+
+    MutationLog(const string& path, FILE* file, size_t bytes);
+    uint64_t append(uint32_t type, int id, const void* payload, uint32_t length);
+    bool reset();
+
+public:
+    ~MutationLog();
+
+    /**
+     * @fn static unique_ptr<MutationLog> MutationLog::open(const char* path, VectorDataset& data)
+     * @brief Replays a log on top of a dataset and opens it for appending.
+     *
+     * Replay stops at the first record that is torn or does not follow from
+     * the dataset, and the log is cut there. Inserts the dataset already has
+     * are skipped, so a log that outlived its checkpoint is harmless.
+     *
+     * @param path The log file, created if it does not exist.
+     * @param data The dataset as of the last checkpoint.
+     * @return The log, or NULL if it could not be opened.
+     */
+    static unique_ptr<MutationLog> open(const char* path, VectorDataset& data);
+
+    /**
+     * @fn uint64_t MutationLog::log_insert_row(int id, RowView row)
+     * @brief Appends the insertion of a row.
+     * @param id The index of the row.
+     * @param row The row.
+     * @return The sequence number to commit.
+     */
+    uint64_t log_insert_row(int id, RowView row);
+
+    /**
+     * @fn uint64_t MutationLog::log_delete_row(int id)
+     * @brief Appends the deletion of a row.
+     * @param id The index of the row.
+     * @return The sequence number to commit.
+     */
+    uint64_t log_delete_row(int id);
+
+    /**
+     * @fn bool MutationLog::commit(uint64_t sequence)
+     * @brief Waits until every record up to a sequence number is on disk.
+     * @param sequence The sequence number.
+     * @return False if the log could not be written.
+     */
+    bool commit(uint64_t sequence);
+
+    /**
+     * @fn bool MutationLog::checkpoint(VectorDataset& data, const char* bin_path, const char* deleted_path)
+     * @brief Writes the dataset to its files and empties the log.
+     * @param data The dataset.
+     * @param bin_path The binary dataset file.
+     * @param deleted_path The list of deleted rows.
+     * @return False if a file could not be written, the log is then kept.
+     */
+    bool checkpoint(VectorDataset& data, const char* bin_path, const char* deleted_path);
 
-    rp_tree_node* left;
-    rp_tree_node* right;
+    /**
+     * @fn size_t MutationLog::size()
+     * @brief Gets the size of the log file, records not yet written included.
+     * @return The size in bytes.
+     */
+    size_t size();
 };
 
-class TreeIndex
+/**
+ * @class shared_blocks
+ * @brief An array of rows kept in fixed blocks, which copies of the array
+ * share until they write to them.
+ *
+ * Copying the array copies the list of blocks and not the rows, so a new
+ * version of an index costs a pointer per block. A copy writes in place
+ * only to the blocks it allocated itself and copies any other block first,
+ * so the versions still sharing that block never see the change. A row is
+ * width values, never split across blocks, and blocks are 64-byte aligned
+ * like the dataset, so rows of a dataset's stride suit the distance kernels.
+ *
+ * @var shared_blocks::blocks
+ * @brief The blocks, 1 << shift rows each.
+ * @var shared_blocks::owned
+ * @brief Whether this array allocated the block, and may write to it in place.
+ * @var shared_blocks::rows
+ * @brief The number of rows.
+ */
+template<class T>
+class shared_blocks
 {
-    static TreeIndex *instance;
-protected:
-    VectorDataset D;
-    TreeIndex();
-    
-public:
-    static TreeIndex &GetInstance()
+    vector<shared_ptr<T>> blocks;
+    vector<char> owned;
+    size_t rows = 0;
+    int shift;
+    int width;
+
+    shared_ptr<T> new_block(const T* from) const
     {
-        if(instance == NULL)
+        size_t count = ((size_t)1 << shift) * width;
+        T* temp = (T*)::operator new(count * sizeof(T), align_val_t(64));
+        if(from != NULL)
         {
-            instance = new TreeIndex();
+            memcpy(temp, from, count * sizeof(T));
         }
-        return *instance;
+        else
+        {
+            memset(temp, 0, count * sizeof(T));
+        }
+        return shared_ptr<T>(temp, [](T* p) { ::operator delete(p, align_val_t(64)); });
     }
 
-    void add_datavector(DataVector vec)
+public:
+    static_assert(is_trivially_copyable<T>::value, "blocks are copied bytewise");
+
+    explicit shared_blocks(int shift, int width = 1) : shift(shift), width(width) {}
+
+    // The copy owns nothing, its first write to any block copies it
+    shared_blocks(const shared_blocks& other) : blocks(other.blocks), owned(other.blocks.size(), 0), rows(other.rows),
+        shift(other.shift), width(other.width) {}
+
+    shared_blocks& operator=(const shared_blocks& other) = delete;
+
+    size_t size() const
     {
-        D.add_vector(vec);
+        return rows;
     }
-};
 
-class KDTreeIndex : public TreeIndex
-{
-    struct kd_tree_node* root;
-    static KDTreeIndex *kdinstance;
-public:
-    static KDTreeIndex &GetInstance()
+    bool empty() const
     {
-        if(kdinstance == NULL)
-        {
-            kdinstance = new KDTreeIndex();
-        }
-        return *kdinstance;
+        return rows == 0;
     }
 
-    struct kd_tree_node* get_root()
+    size_t block_rows() const
     {
-        return root;
+        return (size_t)1 << shift;
     }
 
-    void print_kd_tree(struct kd_tree_node* head);
-
-    struct kd_tree_node* new_kd_node(vector<int>* a, int h);   
-
-    void add_kd_vector(DataVector temp);
-
-    void delete_kd_vector(int d); 
-
-    void knn_kd();
+    int row_width() const
+    {
+        return width;
+    }
 
-    void kd_neighbours(int k, DataVector q, int count);
+    const T* row(size_t i) const
+    {
+        return blocks[i >> shift].get() + (i & (block_rows() - 1)) * width;
+    }
 
-private:
-    KDTreeIndex();
-};
+    const T& operator[](size_t i) const
+    {
+        return *row(i);
+    }
 
-class RPTreeIndex : public TreeIndex
-{
-    struct rp_tree_node* root;
-    static RPTreeIndex *rpinstance;
-public:
-    static RPTreeIndex &GetInstance()
+    T* write_row(size_t i)
     {
-        if(rpinstance == NULL)
+        size_t b = i >> shift;
+        if(!owned[b])
         {
-            rpinstance = new RPTreeIndex();
+            blocks[b] = new_block(blocks[b].get());
+            owned[b] = 1;
         }
-        return *rpinstance;
+        return blocks[b].get() + (i & (block_rows() - 1)) * width;
     }
 
-    struct rp_tree_node* new_rp_node(vector<int>* a, int h);
-
-    void print_rp_tree(struct rp_tree_node* head);
-
-    struct rp_tree_node* get_root()
+    T& write(size_t i)
     {
-        return root;
+        return *write_row(i);
     }
 
-    void add_rp_vector( DataVector temp);
-
-    void delete_rp_vector(int d);
+    // Rows up to the end of their block may hold old values, callers write every row they add
+    void resize(size_t n)
+    {
+        size_t needed = (n + block_rows() - 1) >> shift;
+        blocks.resize(min(blocks.size(), needed));
+        owned.resize(blocks.size());
+        while(blocks.size() < needed)
+        {
+            blocks.push_back(new_block(NULL));
+            owned.push_back(1);
+        }
+        rows = n;
+    }
+
+    void push_back(const T& value)
+    {
+        resize(rows + 1);
+        write(rows - 1) = value;
+    }
+
+    void assign(const T* from, size_t n)
+    {
+        blocks.clear();
+        owned.clear();
+        resize(n);
+        for(size_t i = 0; i < n; i += block_rows())
+        {
+            memcpy(write_row(i), from + i * width, min(block_rows(), n - i) * width * sizeof(T));
+        }
+    }
+
+    // The count rows from i on as one run, copied to spill when they cross into another block
+    const T* run(size_t i, size_t count, vector<T>& spill) const
+    {
+        if(count == 0 || (i >> shift) == ((i + count - 1) >> shift))
+        {
+            return row(i);
+        }
+        spill.resize(count * width);
+        for(size_t j = 0; j < count; j++)
+        {
+            memcpy(spill.data() + j * width, row(i + j), width * sizeof(T));
+        }
+        return spill.data();
+    }
+};
+
+// Rows per block of the shared arrays of the trees, as powers of two: nodes
+// and point indices come 4 KB at a time, directions 8 at a time
+static const int node_block_shift = 8;
+static const int id_block_shift = 10;
+static const int direction_block_shift = 3;
+
+/**
+ * @struct flat_node
+ * @brief A node of a KD-Tree or RP-Tree.
+ *
+ * The nodes of a tree are kept in one array in breadth-first order with the
+ * root at 0, and the two children of a node are next to each other. Inserts
+ * graft rebuilt subtrees into whatever pairs of slots are free, so only the
+ * adjacency of siblings survives them. Leaves own a contiguous range of the
+ * tree's permuted array of point indices.
+ *
+ * @var flat_node::split
+ * @brief The median the node splits at. Points at or below it go left.
+ * @var flat_node::axis
+ * @brief The split dimension (KD) or projection id (RP). A leaf holding
+ * count points stores -1 - count instead.
+ * @var flat_node::child
+ * @brief The left child, the right child is at child + 1. For a leaf, the
+ * position of its first point in the index array.
+ */
+struct flat_node
+{
+    double split;
+    int axis;
+    int child;
+
+    bool is_leaf() const
+    {
+        return axis < 0;
+    }
+
+    int leaf_count() const
+    {
+        return -1 - axis;
+    }
+};
+
+/**
+ * @struct index_header
+ * @brief The header of the saved index format.
+ *
+ * A saved index is this 64 byte header followed by one section per tree,
+ * an index_tree_header and then the tree's nodes, point indices, spare
+ * node pairs, spare projection ids and stored directions, each written as
+ * the raw array the index keeps in memory. An index only loads over the
+ * dataset it was built from, which the fingerprint tells apart from others.
+ */
+struct index_header
+{
+    char magic[8];          // "KNNINDX" followed by a zero byte
+    uint32_t version;       // index_format_version
+    uint32_t kind;          // index_kind_kd or index_kind_rp
+    uint32_t dtype;         // size in bytes of one component, 4 or 8
+    uint32_t cols;
+    uint32_t stride;
+    uint32_t leaf_size;
+    uint32_t trees;
+    uint32_t indexed;       // rows of the dataset in the index
+    uint32_t deleted;       // rows of the dataset deleted when the index was built
+    uint32_t fingerprint;   // CRC-32 of the indexed rows
+    uint32_t checksum;      // CRC-32 of the tree sections
+    uint32_t sparse;        // whether the RP directions are sparse
+    char reserved[8];
+};
+
+/**
+ * @struct index_tree_header
+ * @brief The sizes and parameters of one tree of a saved index.
+ */
+struct index_tree_header
+{
+    uint32_t nodes;
+    uint32_t ids;
+    uint32_t spare_pairs;
+    uint32_t directions;
+    uint32_t seed;
+    uint32_t spare_directions;
+    uint64_t projections;   // components of the stored directions, 0 for sparse ones
+};
+
+static const uint32_t index_format_version = 1;
+static const uint32_t index_kind_kd = 1;
+static const uint32_t index_kind_rp = 2;
+
+/**
+ * @struct build_scratch
+ * @brief Working space of a tree build over the points ids[first, first + count).
+ *
+ * Every point gets two entries, one in each half of pairs, at its offset
+ * from first, so a subtree rebuilt at the end of ids needs no more room
+ * than its own points.
+ *
+ * @var build_scratch::pairs
+ * @brief The entries, the spare half after the first.
+ * @var build_scratch::first
+ * @brief The position in ids of the first point of the build.
+ */
+struct build_scratch
+{
+    pmr::vector<pair<double, int>> pairs;
+    int first;
+
+    build_scratch(int first, int count, pmr::memory_resource* arena) : pairs(2 * (size_t)count, arena), first(first) {}
+
+    pair<double, int>* values(int begin)
+    {
+        return pairs.data() + (begin - first);
+    }
+
+    pair<double, int>* spare(int begin)
+    {
+        return pairs.data() + pairs.size() / 2 + (begin - first);
+    }
+};
+
+/**
+ * @struct knn_result
+ * @brief The neighbours found for one query, nearest first.
+ *
+ * @var knn_result::ids
+ * @brief The indices of the neighbours in the training set.
+ * @var knn_result::distances
+ * @brief The Euclidean distances of the neighbours to the query.
+ */
+struct knn_result
+{
+    vector<int> ids;
+    vector<double> distances;
+
+    int size() const
+    {
+        return ids.size();
+    }
+};
+
+/**
+ * @class TopK
+ * @brief The k smallest distances offered so far, with their ids.
+ *
+ * The storage is sized once by reset() and reused. Distances and ids are
+ * kept in separate arrays, so no entry is padded. Up to sorted_up_to
+ * entries they are kept sorted, so an insertion is a short shift and the
+ * bound is the last entry. Larger k keep a max-heap instead.
+ */
+class TopK
+{
+    vector<double> dist;
+    vector<int> id;
+    int k;
+    int n;
+    bool heap;
+
+    void sift_down(int i, double d, int x);
+
+public:
+    static const int sorted_up_to = 32;
+
+    TopK() : k(0), n(0), heap(false) {}
+
+    /**
+     * @fn void TopK::reset(int k)
+     * @brief Empties the collector and makes room for k entries.
+     * @param k The number of entries kept.
+     */
+    void reset(int k);
+
+    int size() const
+    {
+        return n;
+    }
+
+    /**
+     * @fn double TopK::bound() const
+     * @brief Gets the distance an entry has to beat to be kept.
+     * @return The kth smallest distance, or HUGE_VAL while fewer than k are kept.
+     */
+    double bound() const
+    {
+        if(n < k)
+        {
+            return HUGE_VAL;
+        }
+        return heap ? dist[0] : dist[n - 1];
+    }
+
+    /**
+     * @fn bool TopK::push(double d, int x)
+     * @brief Offers an entry.
+     * @param d The distance.
+     * @param x The id.
+     * @return False if it was not kept.
+     */
+    bool push(double d, int x)
+    {
+        if(k == 0 || (n == k && d >= bound()))
+        {
+            return false;
+        }
+
+        if(heap)
+        {
+            if(n < k)
+            {
+                // Sift the new entry up from the end
+                int i = n++;
+                while(i > 0 && dist[(i - 1) / 2] < d)
+                {
+                    dist[i] = dist[(i - 1) / 2];
+                    id[i] = id[(i - 1) / 2];
+                    i = (i - 1) / 2;
+                }
+                dist[i] = d;
+                id[i] = x;
+            }
+            else
+            {
+                sift_down(0, d, x);
+            }
+            return true;
+        }
+
+        // Shift larger entries up by one, dropping the last when full
+        int i = n < k ? n++ : n - 1;
+        while(i > 0 && dist[i - 1] > d)
+        {
+            dist[i] = dist[i - 1];
+            id[i] = id[i - 1];
+            i--;
+        }
+        dist[i] = d;
+        id[i] = x;
+        return true;
+    }
+
+    /**
+     * @fn void TopK::merge(const TopK& other)
+     * @brief Offers every entry of another collector.
+     * @param other The other collector.
+     */
+    void merge(const TopK& other);
+
+    /**
+     * @fn void TopK::sorted(knn_result& result) const
+     * @brief Copies the entries out, smallest distance first, leaving the collector as it is.
+     * @param result The entries.
+     */
+    void sorted(knn_result& result) const;
+};
+
+/**
+ * @class ResultSink
+ * @brief Where the results of the queries are written.
+ *
+ * open() gives one of the built in sinks:
+ * - "none" drops the results, so only the search is timed.
+ * - "text" writes a "query i" line followed by one "id distance" line per
+ *   neighbour.
+ * - "binary" writes the magic "KNNRSLT" and a zero byte, then for every
+ *   query its index and neighbour count as int32, the ids as int32 and the
+ *   distances as float64.
+ * - "vectors" prints every neighbour in full, for debugging.
+ */
+class ResultSink
+{
+public:
+    virtual ~ResultSink() {}
+
+    /**
+     * @fn void ResultSink::write(int query, int k, const knn_result& result)
+     * @brief Writes the result of one query.
+     * @param query The index of the query.
+     * @param k The number of neighbours asked for.
+     * @param result The neighbours found.
+     */
+    virtual void write(int query, int k, const knn_result& result) = 0;
+
+    /**
+     * @fn static shared_ptr<ResultSink> ResultSink::open(const char* mode, const char* path)
+     * @brief Creates a built in sink.
+     * @param mode "none", "text", "binary" or "vectors".
+     * @param path The file to write to, NULL for standard output.
+     * @return The sink, or NULL if the mode is unknown or the file could not be opened.
+     */
+    static shared_ptr<ResultSink> open(const char* mode, const char* path);
+};
+
+/**
+ * @struct visited_set
+ * @brief The points a query has already looked at, for searches that can
+ * reach the same point more than once.
+ *
+ * Every slot holds the epoch in which it was last marked, so starting a new
+ * query only bumps the epoch instead of clearing the array.
+ */
+struct visited_set
+{
+    vector<uint32_t> stamps;
+    uint32_t epoch = 0;
+
+    /**
+     * @fn void visited_set::clear(int n)
+     * @brief Forgets every point, making room for the indices [0, n).
+     * @param n The number of points.
+     */
+    void clear(int n)
+    {
+        if((int)stamps.size() < n)
+        {
+            stamps.resize(n, 0);
+        }
+        if(++epoch == 0)
+        {
+            fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    /**
+     * @fn bool visited_set::insert(int i)
+     * @brief Marks a point as seen.
+     * @param i The index of the point.
+     * @return False if it was already seen.
+     */
+    bool insert(int i)
+    {
+        if(stamps[i] == epoch)
+        {
+            return false;
+        }
+        stamps[i] = epoch;
+        return true;
+    }
+};
+
+/**
+ * @struct search_branch
+ * @brief A subtree left for later by a best-first search.
+ *
+ * @var search_branch::bound
+ * @brief A lower bound on the squared distance from the query to the subtree.
+ * @var search_branch::node
+ * @brief The root of the subtree.
+ * @var search_branch::path
+ * @brief The last cell offset on the way to the subtree, -1 for none.
+ */
+struct search_branch
+{
+    double bound;
+    int node;
+    int path;
+
+    bool operator<(const search_branch& other) const
+    {
+        return bound > other.bound;
+    }
+};
+
+/**
+ * @struct cell_offset
+ * @brief How far the query lies outside a subtree's cell along one axis.
+ *
+ * The offsets on the way to a subtree form a list through prev, and the
+ * bound of the subtree is the sum of their squares, each axis counted once.
+ */
+struct cell_offset
+{
+    int axis;
+    int prev;
+    double squared;
+};
+
+/**
+ * @struct search_scratch
+ * @brief The working memory of a search, kept per thread and reused by
+ * every query the thread answers.
+ *
+ * @var search_scratch::query
+ * @brief The query copied and padded to the stride of the dataset.
+ * @var search_scratch::stack
+ * @brief The nodes left to visit with a bound on their squared distance.
+ * @var search_scratch::nearest
+ * @brief The neighbours found so far.
+ * @var search_scratch::visited
+ * @brief The points already offered, when they can be reached twice.
+ * @var search_scratch::queue
+ * @brief The min-heap of subtrees left by a best-first search.
+ * @var search_scratch::offsets
+ * @brief The cell offsets the queued subtrees point into.
+ * @var search_scratch::leaf
+ * @brief The points of a leaf whose range crosses two blocks of ids.
+ */
+struct search_scratch
+{
+    vector<scalar_t> query;
+    vector<pair<int, double>> stack;
+    TopK nearest;
+    visited_set visited;
+    vector<search_branch> queue;
+    vector<cell_offset> offsets;
+    vector<int> leaf;
+};
+
+/**
+ * @class TreeIndex
+ * @brief Base class of the indexes, holding the dataset they search.
+ *
+ * The training set is loaded once and shared by reference count between
+ * every index, so the KD-tree and the RP-tree search the same copy.
+ *
+ * @var TreeIndex::dataset
+ * @brief The shared training set, loaded by the first index that needs it.
+ * @var TreeIndex::data
+ * @brief This index's reference to the shared training set.
+ * @var TreeIndex::D
+ * @brief Shorthand for *data.
+ * @var TreeIndex::view
+ * @brief The rows this version of the index searches, taken when it was
+ * built and again when it was published. Builds and searches read the
+ * rows through it and never through D, which writers may be growing at
+ * the same time.
+ * @var TreeIndex::scan_order
+ * @brief The offsets of the blocks of a row holding data, in the order
+ * distance scans sum them.
+ */
+class TreeIndex
+{
+    static shared_ptr<VectorDataset> dataset;
+protected:
+    shared_ptr<VectorDataset> data;
+    VectorDataset& D;
+    dataset_snapshot view;
+    vector<int> scan_order;
+    TreeIndex();
+
+    /**
+     * @fn void TreeIndex::scan_leaf(const int* points, int count, const scalar_t* q, double q_norm, TopK& nearest, visited_set* seen)
+     * @brief Offers the points of a leaf to the k nearest neighbours found so far.
+     * @param points The indices of the points.
+     * @param count The number of points.
+     * @param q The query, padded to the stride of the dataset.
+     * @param q_norm The squared norm of q.
+     * @param nearest The neighbours found so far, by squared distance.
+     * @param seen The points already offered, which are skipped, or NULL
+     * when no point can be offered twice.
+     */
+    void scan_leaf(const int* points, int count, const scalar_t* q, double q_norm, TopK& nearest, visited_set* seen = NULL);
+    
+public:
+    static TreeIndex &GetInstance()
+    {
+        // Created once even when writers on several threads ask for it together
+        static TreeIndex* instance = new TreeIndex();
+        return *instance;
+    }
+
+    /**
+     * @var TreeIndex::sample_median_above
+     * @brief Nodes with more points than this pick a pivot from a sample of
+     * their points before selecting the exact median, 0 to never sample.
+     * Default is 65536.
+     */
+    static int sample_median_above;
+
+    /**
+     * @var TreeIndex::parallel_cutoff
+     * @brief Subtrees with more points than this build their two halves as
+     * separate tasks, smaller ones recurse on one thread. Nodes with more
+     * than 8 times as many points also spread the projection and the median
+     * selection over the pool. Default is 2048.
+     */
+    static int parallel_cutoff;
+
+    /**
+     * @var TreeIndex::reorder_dimensions
+     * @brief Distance scans sum the blocks of dimensions that vary the most
+     * first, so candidates that lose are abandoned sooner. Otherwise blocks
+     * are summed in row order. Default is true.
+     */
+    static bool reorder_dimensions;
+
+    /**
+     * @var TreeIndex::norm_distances
+     * @brief Leaf scans compute distances as |x|^2 + |q|^2 - 2 x.q from the
+     * cached row norms, taking the dot products of a whole leaf together.
+     * Otherwise every candidate is summed blockwise and abandoned once it
+     * loses, which is faster when most candidates lose early, as they do on
+     * images. Default is false, set with --leaf-scan norms.
+     */
+    static bool norm_distances;
+
+    /**
+     * @var TreeIndex::compaction_threshold
+     * @brief The share of the points of an index that may be deleted before
+     * it is rebuilt without them in the background. Default is 0.1.
+     */
+    static double compaction_threshold;
+
+    /**
+     * @var TreeIndex::checkpoint_bytes
+     * @brief The size the mutation log may reach before it is folded back
+     * into fmnist-train.bin. Default is 64 MiB.
+     */
+    static size_t checkpoint_bytes;
+
+    /**
+     * @var TreeIndex::mutation_log
+     * @brief The log of the changes to the shared training set, opened with it.
+     */
+    static unique_ptr<MutationLog> mutation_log;
+
+    /**
+     * @var TreeIndex::layout_lock
+     * @brief Held exclusively while a row is added to the shared training
+     * set, which may move it, and shared by everything else that changes
+     * the training set or an index. Searches never take it.
+     */
+    static shared_mutex layout_lock;
+
+    /**
+     * @var TreeIndex::result_sink
+     * @brief Where knn_kd, knn_rp and the neighbour routines write their
+     * results. Default is compact text on standard output.
+     */
+    static shared_ptr<ResultSink> result_sink;
+
+    /**
+     * @fn static shared_ptr<VectorDataset> TreeIndex::SharedDataset()
+     * @brief Gives the shared training set, reading it on the first call.
+     * @return The shared training set, or NULL if it could not be read.
+     */
+    static shared_ptr<VectorDataset> SharedDataset();
+
+    /**
+     * @fn int TreeIndex::add_datavector(DataVector vec)
+     * @brief Adds a vector to the shared training set and logs it.
+     * @param vec The vector to add.
+     * @return The index of the new vector, or -1 if it was rejected.
+     */
+    int add_datavector(DataVector vec);
+
+    /**
+     * @fn bool TreeIndex::delete_datavector(int d)
+     * @brief Deletes a vector from the shared training set and logs it.
+     * @param d The index of the vector.
+     * @return False if there is no vector with that index.
+     */
+    bool delete_datavector(int d);
+
+protected:
+    /**
+     * @var TreeIndex::deleted_at_build
+     * @brief The number of deleted rows when the index was built. Rows
+     * deleted since are still in it.
+     */
+    int deleted_at_build;
+
+    /**
+     * @fn bool TreeIndex::needs_compaction(int rows) const
+     * @brief Checks whether enough of an index is deleted to rebuild it.
+     * @param rows The number of rows of the training set the index covers.
+     * @return True once the deleted share passes compaction_threshold.
+     */
+    bool needs_compaction(int rows) const;
+};
+
+/**
+ * @class KDTreeIndex
+ * @brief KD-Tree over the shared training set.
+ *
+ * Updates publish a new version of the tree instead of changing the one
+ * searches may be reading, so searches never wait for an update or see
+ * half of one.
+ *
+ * @var KDTreeIndex::arena
+ * @brief Holds the spare pairs, released in one operation.
+ * @var KDTreeIndex::nodes
+ * @brief The nodes of the tree in breadth-first order, shared with the
+ * versions this one was copied from until an insert changes them.
+ * @var KDTreeIndex::ids
+ * @brief The point indices, grouped by leaf, shared like the nodes. Leaves
+ * that grew since the build have moved their range to the end, the places
+ * they left are reclaimed once they outnumber the points.
+ * @var KDTreeIndex::spare_pairs
+ * @brief Pairs of node slots freed by subtree rebuilds, for reuse.
+ * @var KDTreeIndex::indexed
+ * @brief The number of rows of the training set in the tree.
+ */
+class KDTreeIndex : public TreeIndex
+{
+    pmr::monotonic_buffer_resource arena;
+    shared_blocks<flat_node> nodes{node_block_shift};
+    shared_blocks<int> ids{id_block_shift};
+    pmr::vector<int> spare_pairs{&arena};
+    int indexed = 0;
+    static shared_ptr<KDTreeIndex> current;
+    static mutex publishing;
+    static future<void> rebuilding;
+public:
+    /**
+     * @var KDTreeIndex::leaf_size
+     * @brief The most points a leaf may hold before it is split. Default is 32.
+     */
+    static int leaf_size;
+
+    /**
+     * @var KDTreeIndex::max_checks
+     * @brief The most distances one search computes before it returns the
+     * best found so far, 0 for an exact search. Default is 0.
+     */
+    static int max_checks;
+
+    /**
+     * @var KDTreeIndex::index_path
+     * @brief The file the tree is loaded from instead of being built, and
+     * saved to whenever it is built, or NULL. Default is NULL.
+     */
+    static const char* index_path;
+
+    /**
+     * @fn static shared_ptr<KDTreeIndex> KDTreeIndex::GetInstance()
+     * @brief Gives the current version of the tree, loading or building the first.
+     *
+     * The version never changes, updates publish a new one instead. It
+     * stays alive for as long as the caller holds it.
+     *
+     * @return The current version.
+     */
+    static shared_ptr<KDTreeIndex> GetInstance()
+    {
+        shared_ptr<KDTreeIndex> version = atomic_load(&current);
+        return version != NULL ? version : load_or_build();
+    }
+
+    /**
+     * @fn bool KDTreeIndex::save(const char* path)
+     * @brief Writes the tree in the saved index format.
+     * @param path The index file.
+     * @return False if the file could not be written.
+     */
+    bool save(const char* path);
+
+    /**
+     * @fn static KDTreeIndex* KDTreeIndex::load(const char* path)
+     * @brief Reads a tree saved by save without building anything.
+     *
+     * Rows added to the training set since the tree was saved are then
+     * inserted into it.
+     *
+     * @param path The index file.
+     * @return The tree, or NULL if the file is missing, damaged, or was
+     * saved for another dataset or with another leaf_size.
+     */
+    static KDTreeIndex* load(const char* path);
+
+    /**
+     * @fn void KDTreeIndex::print_kd_tree(int node, int height)
+     * @brief Prints the subtree rooted at a node.
+     * @param node The node, 0 for the whole tree.
+     * @param height The height of the node.
+     */
+    void print_kd_tree(int node = 0, int height = 0);
+
+    /**
+     * @fn void KDTreeIndex::build_kd_tree()
+     * @brief Builds the tree over the rows of view that are not deleted.
+     */
+    void build_kd_tree();
+
+    /**
+     * @fn void KDTreeIndex::new_kd_node(pmr::vector<flat_node>& tree, int* points, build_scratch& scratch, int node, int begin, int end)
+     * @brief Builds the subtree over points[begin, end) in depth-first order.
+     * @param tree The nodes being built, left child of a node right after it.
+     * @param points The point indices, grouped by leaf as the build goes.
+     * @param scratch Working space with two entries for every point of the build.
+     * @param node The slot of the subtree root in tree.
+     * @param begin The first point of the subtree in points.
+     * @param end One past the last point of the subtree in points.
+     */
+    void new_kd_node(pmr::vector<flat_node>& tree, int* points, build_scratch& scratch, int node, int begin, int end);
+
+    /**
+     * @fn static void KDTreeIndex::add_kd_vector(int d)
+     * @brief Publishes a version of the KD-Tree with a vector added to the shared training set.
+     * @param d The index of the new vector, ignored if the tree already has it.
+     */
+    static void add_kd_vector(int d);
+
+    /**
+     * @fn static void KDTreeIndex::delete_kd_vector(int d)
+     * @brief Updates the KD-Tree after a vector was deleted from the shared training set.
+     * @param d The index of the vector, ignored if the tree never had it.
+     */
+    static void delete_kd_vector(int d);
+
+    /**
+     * @fn static void KDTreeIndex::finish_compaction()
+     * @brief Waits until a background compaction is published and saved.
+     */
+    static void finish_compaction();
+
+    void knn_kd();
+
+    /**
+     * @fn void KDTreeIndex::kd_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+     * @brief Finds the k nearest neighbours of q.
+     * @param q The query, padded to the stride of the dataset.
+     * @param k The number of neighbours.
+     * @param scratch The working memory of the calling thread.
+     * @param result The neighbours found.
+     */
+    void kd_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result);
+
+    /**
+     * @fn vector<knn_result> KDTreeIndex::kd_batch(VectorDataset& queries, int k)
+     * @brief Finds the k nearest neighbours of every query, in parallel on the shared pool.
+     * @param queries The queries.
+     * @param k The number of neighbours.
+     * @return The neighbours of every query.
+     */
+    vector<knn_result> kd_batch(VectorDataset& queries, int k);
+
+    /**
+     * @fn knn_result KDTreeIndex::kd_neighbours(int k, DataVector q, int count)
+     * @brief Finds the k nearest neighbours of q and writes them to the result sink.
+     * @param k The number of neighbours.
+     * @param q The query vector.
+     * @param count The index of the query, passed to the sink.
+     * @return The neighbours found.
+     */
+    knn_result kd_neighbours(int k, DataVector q, int count);
+
+private:
+    /**
+     * @fn KDTreeIndex::KDTreeIndex(bool build)
+     * @brief Constructs the index over the shared training set.
+     * @param build Whether to build the tree, otherwise it is left empty for load.
+     */
+    KDTreeIndex(bool build = true);
+
+    /**
+     * @fn KDTreeIndex::KDTreeIndex(const KDTreeIndex& other)
+     * @brief Copies a version of the tree, for an update to change.
+     * @param other The version.
+     */
+    KDTreeIndex(const KDTreeIndex& other);
+
+    /**
+     * @fn static shared_ptr<KDTreeIndex> KDTreeIndex::load_or_build()
+     * @brief Loads the tree from index_path, or builds it and saves it
+     * there, and publishes it unless another thread got there first.
+     * @return The current version.
+     */
+    static shared_ptr<KDTreeIndex> load_or_build();
+
+    /**
+     * @fn static void KDTreeIndex::publish(shared_ptr<KDTreeIndex> version)
+     * @brief Makes a version the one new searches get.
+     *
+     * Called with publishing and layout_lock held.
+     *
+     * @param version The version, which must not change any more.
+     */
+    static void publish(shared_ptr<KDTreeIndex> version);
+
+    /**
+     * @fn void KDTreeIndex::catch_up()
+     * @brief Inserts the rows added to the training set since the tree last saw it.
+     */
+    void catch_up();
+
+    /**
+     * @fn int KDTreeIndex::split_dimension(const int* points, int begin, int end)
+     * @brief Picks the dimension in which the points points[begin, end) vary the most.
+     * @param points The point indices.
+     * @param begin The first point in points.
+     * @param end One past the last point in points.
+     * @return The dimension.
+     */
+    int split_dimension(const int* points, int begin, int end);
+
+    /**
+     * @fn void KDTreeIndex::rebuild_kd_subtree(int node)
+     * @brief Rebuilds the subtree rooted at a node from its points.
+     * @param node The root of the subtree, which keeps its slot.
+     */
+    void rebuild_kd_subtree(int node);
+};
+
+/**
+ * @struct rp_tree
+ * @brief One random projection tree of an RP forest.
+ *
+ * The nodes, point indices and directions are shared with the versions
+ * the tree was copied from, an insert only copies the blocks it changes.
+ *
+ * @var rp_tree::nodes
+ * @brief The nodes of the tree in breadth-first order.
+ * @var rp_tree::ids
+ * @brief The point indices, grouped by leaf.
+ * @var rp_tree::projections
+ * @brief The unit Gaussian directions the internal nodes project onto, one
+ * padded row of the dataset's stride per projection id. Empty for sparse
+ * directions.
+ * @var rp_tree::taps
+ * @brief The taps of the sparse directions, one row of sparse_runs(d) per
+ * projection id. They are hashed from the seed when the node is built and
+ * when the tree is loaded, and never saved. Empty for Gaussian directions.
+ * @var rp_tree::seed
+ * @brief The seed the directions are drawn from. Each projection id gets
+ * its own generator, so the tree does not depend on the build order.
+ * @var rp_tree::sparse
+ * @brief Whether the directions are sparse.
+ * @var rp_tree::spare_pairs
+ * @brief Pairs of node slots freed by subtree rebuilds, for reuse.
+ * @var rp_tree::spare_directions
+ * @brief Projection ids freed by subtree rebuilds, for reuse, so the
+ * stored directions do not grow with every rebuild.
+ * @var rp_tree::directions
+ * @brief The number of projection ids handed out.
+ */
+struct rp_tree
+{
+    shared_blocks<flat_node> nodes{node_block_shift};
+    shared_blocks<int> ids{id_block_shift};
+    shared_blocks<scalar_t> projections;
+    shared_blocks<int> taps;
+    unsigned seed = 0;
+    bool sparse = false;
+    pmr::vector<int> spare_pairs;
+    pmr::vector<int> spare_directions;
+    int directions = 0;
+
+    rp_tree(pmr::memory_resource* arena, int stride, int runs) : projections(direction_block_shift, stride),
+        taps(direction_block_shift, runs), spare_pairs(arena), spare_directions(arena) {}
+
+    rp_tree(const rp_tree& other, pmr::memory_resource* arena) : nodes(other.nodes), ids(other.ids),
+        projections(other.projections), taps(other.taps), seed(other.seed), sparse(other.sparse),
+        spare_pairs(other.spare_pairs, arena), spare_directions(other.spare_directions, arena), directions(other.directions) {}
+};
+
+/**
+ * @class RPTreeIndex
+ * @brief Random projection tree, or forest of them, over the shared training set.
+ *
+ * @var RPTreeIndex::arena
+ * @brief Holds the spare pairs and projection ids, released in one operation.
+ * @var RPTreeIndex::forest
+ * @brief The trees, all over the same points but split along different
+ * directions.
+ * @var RPTreeIndex::indexed
+ * @brief The number of rows of the training set in the trees.
+ */
+class RPTreeIndex : public TreeIndex
+{
+    pmr::monotonic_buffer_resource arena;
+    vector<rp_tree> forest;
+    int indexed = 0;
+    static shared_ptr<RPTreeIndex> current;
+    static mutex publishing;
+    static future<void> rebuilding;
+
+    void build_forest();
+    void build_rp_tree(rp_tree& tree, const vector<int>& live);
+    void insert_rp_point(rp_tree& tree, int id);
+    void rebuild_rp_subtree(rp_tree& tree, int node);
+public:
+    /**
+     * @var RPTreeIndex::leaf_size
+     * @brief The most points a leaf may hold before it is split. Default is 32.
+     */
+    static int leaf_size;
+
+    /**
+     * @var RPTreeIndex::trees
+     * @brief The number of trees built. A single tree is searched exactly,
+     * a forest returns the best of the leaves the query falls in, one per
+     * tree, which trades recall for time and memory. Default is 1.
+     */
+    static int trees;
+
+    /**
+     * @var RPTreeIndex::sparse_projections
+     * @brief Splits project onto very sparse directions, one +1 or -1 entry
+     * in every sqrt(d) dimensions, instead of dense Gaussian ones. They are
+     * not stored, so a node costs no memory beyond its flat_node, and a
+     * projection reads sqrt(d) values instead of d. Default is false.
+     */
+    static bool sparse_projections;
+
+    /**
+     * @var RPTreeIndex::seed
+     * @brief The seed every build draws the seeds of its trees from, so
+     * the same dataset always gives the same forest. 0 draws them from
+     * rand() instead. Default is 0.
+     */
+    static unsigned seed;
+
+    /**
+     * @var RPTreeIndex::index_path
+     * @brief The file the forest is loaded from instead of being built,
+     * and saved to whenever it is built, or NULL. Default is NULL.
+     */
+    static const char* index_path;
+
+    /**
+     * @fn static shared_ptr<RPTreeIndex> RPTreeIndex::GetInstance()
+     * @brief Gives the current version of the forest, loading or building the first.
+     *
+     * Works like the KD-Tree version.
+     *
+     * @return The current version.
+     */
+    static shared_ptr<RPTreeIndex> GetInstance()
+    {
+        shared_ptr<RPTreeIndex> version = atomic_load(&current);
+        return version != NULL ? version : load_or_build();
+    }
+
+    /**
+     * @fn bool RPTreeIndex::save(const char* path)
+     * @brief Writes the forest in the saved index format.
+     * @param path The index file.
+     * @return False if the file could not be written.
+     */
+    bool save(const char* path);
+
+    /**
+     * @fn static RPTreeIndex* RPTreeIndex::load(const char* path)
+     * @brief Reads a forest saved by save without building anything.
+     *
+     * Sparse directions are drawn again from the saved seeds, Gaussian ones
+     * are read back. Rows added to the training set since the forest was
+     * saved are then inserted into it.
+     *
+     * @param path The index file.
+     * @return The forest, or NULL if the file is missing, damaged, or was
+     * saved for another dataset or with other trees, leaf_size or
+     * sparse_projections.
+     */
+    static RPTreeIndex* load(const char* path);
+
+    /**
+     * @fn void RPTreeIndex::new_rp_node(rp_tree& tree, pmr::vector<flat_node>& nodes, int* points, build_scratch& scratch, int node, int begin, int end, int proj, const int* proj_ids)
+     * @brief Builds the subtree over points[begin, end) in depth-first order.
+     * @param tree The tree the directions belong to.
+     * @param nodes The nodes being built, left child of a node right after it.
+     * @param points The point indices, grouped by leaf as the build goes.
+     * @param scratch Working space with two entries for every point of the build.
+     * @param node The slot of the subtree root in nodes.
+     * @param begin The first point of the subtree in points.
+     * @param end One past the last point of the subtree in points.
+     * @param proj The first projection id the subtree may use.
+     * @param proj_ids The projection ids to use in place of proj, proj + 1
+     * and so on, or NULL to use those.
+     */
+    void new_rp_node(rp_tree& tree, pmr::vector<flat_node>& nodes, int* points, build_scratch& scratch, int node, int begin, int end, int proj, const int* proj_ids = NULL);
+
+    /**
+     * @fn void RPTreeIndex::print_rp_tree(int node, int height, int tree)
+     * @brief Prints the subtree rooted at a node.
+     * @param node The node, 0 for the whole tree.
+     * @param height The height of the node.
+     * @param tree The tree of the forest the node is in.
+     */
+    void print_rp_tree(int node = 0, int height = 0, int tree = 0);
+
+    /**
+     * @fn static void RPTreeIndex::add_rp_vector(int d)
+     * @brief Publishes a version of the forest with a vector added to the shared training set.
+     * @param d The index of the new vector, ignored if the forest already has it.
+     */
+    static void add_rp_vector(int d);
+
+    /**
+     * @fn static void RPTreeIndex::delete_rp_vector(int d)
+     * @brief Updates the RP-Tree after a vector was deleted from the shared training set.
+     * @param d The index of the vector, ignored if the forest never had it.
+     */
+    static void delete_rp_vector(int d);
+
+    /**
+     * @fn static void RPTreeIndex::finish_compaction()
+     * @brief Waits until a background compaction is published and saved.
+     */
+    static void finish_compaction();
 
     void knn_rp();
 
-    void rp_neighbours(int k, DataVector q, int count);
+    /**
+     * @fn void RPTreeIndex::rp_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result)
+     * @brief Finds the k nearest neighbours of q.
+     * @param q The query, padded to the stride of the dataset.
+     * @param k The number of neighbours.
+     * @param scratch The working memory of the calling thread.
+     * @param result The neighbours found.
+     */
+    void rp_search(const scalar_t* q, int k, search_scratch& scratch, knn_result& result);
+
+    /**
+     * @fn vector<knn_result> RPTreeIndex::rp_batch(VectorDataset& queries, int k)
+     * @brief Finds the k nearest neighbours of every query, in parallel on the shared pool.
+     * @param queries The queries.
+     * @param k The number of neighbours.
+     * @return The neighbours of every query.
+     */
+    vector<knn_result> rp_batch(VectorDataset& queries, int k);
+
+    /**
+     * @fn knn_result RPTreeIndex::rp_neighbours(int k, DataVector q, int count)
+     * @brief Finds the k nearest neighbours of q and writes them to the result sink.
+     * @param k The number of neighbours.
+     * @param q The query vector.
+     * @param count The index of the query, passed to the sink.
+     * @return The neighbours found.
+     */
+    knn_result rp_neighbours(int k, DataVector q, int count);
 
 private:
-    RPTreeIndex();
+    /**
+     * @fn RPTreeIndex::RPTreeIndex(bool build)
+     * @brief Constructs the index over the shared training set.
+     * @param build Whether to build the forest, otherwise it is left empty for load.
+     */
+    RPTreeIndex(bool build = true);
+
+    /**
+     * @fn RPTreeIndex::RPTreeIndex(const RPTreeIndex& other)
+     * @brief Copies a version of the forest, for an update to change.
+     * @param other The version.
+     */
+    RPTreeIndex(const RPTreeIndex& other);
+
+    /**
+     * @fn static shared_ptr<RPTreeIndex> RPTreeIndex::load_or_build()
+     * @brief Loads the forest from index_path, or builds it and saves it
+     * there, and publishes it unless another thread got there first.
+     * @return The current version.
+     */
+    static shared_ptr<RPTreeIndex> load_or_build();
+
+    /**
+     * @fn static void RPTreeIndex::publish(shared_ptr<RPTreeIndex> version)
+     * @brief Makes a version the one new searches get.
+     *
+     * Called with publishing and layout_lock held.
+     *
+     * @param version The version, which must not change any more.
+     */
+    static void publish(shared_ptr<RPTreeIndex> version);
+
+    /**
+     * @fn void RPTreeIndex::catch_up()
+     * @brief Inserts the rows added to the training set since the forest last saw them.
+     */
+    void catch_up();
 };
\ No newline at end of file